@@ -2,10 +2,13 @@
 #define GEOMETRY2D
 
 #include <numeric>
+#include <stdexcept>
 
 #include <Eigen/Dense>
+#include <Eigen/SparseCore>
 
 #include "Lattice2D.h"
+#include "Permutations.h"
 
 enum TRAVERSE2D {CHESSBOARD, SNAKE};
 
@@ -16,24 +19,61 @@ public:
 	/**constant coupling λ*/
 	Geometry2D (const Lattice2D &lattice_input, TRAVERSE2D path_input, vector<double> lambda={1.});
 	
+	/**constant coupling λ applied to a precomputed neighbor topology (the hopping matrices for λ=1, e.g. from GeometryCache)*/
+	Geometry2D (const Lattice2D &lattice_input, TRAVERSE2D path_input, vector<double> lambda, const vector<Eigen::SparseMatrix<double,Eigen::RowMajor> > &topology);
+	
 	// /**constant couplings λx and λy*/
 	// Geometry2D (const Lattice<2> &lattice_input, TRAVERSE2D path_input, int Lx_input, int Ly_input, double lambda_x, double lambda_y, bool PERIODIC_Y=false);
 	
 	// /**arbitrary couplings (coupling_y is of size Ly+1 and the last element sets the boundary condition)*/
 	// Geometry2D (const Lattice<2> &lattice_in, TRAVERSE2D path_input, int Lx_input, int Ly_input, const ArrayXd coupling_x, const ArrayXd coupling_y);
 	
-	/**return hopping matrix*/
-	Eigen::ArrayXXd hopping(size_t range=1ul) const {assert(range>0 and range<=coupling_neighbor.size()); return HoppingMatrix[range-1];}
+	/**return hopping matrix (dense view of the sparse storage)*/
+	Eigen::ArrayXXd hopping(size_t range=1ul) const {assert(range>0 and range<=coupling_neighbor.size()); return Eigen::MatrixXd(HoppingMatrix[range-1]).array();}
+	
+	/**return hopping matrix in CSR format, the nonzeros of row i are the neighbors of site i*/
+	const Eigen::SparseMatrix<double,Eigen::RowMajor> &hoppingSparse(size_t range=1ul) const {assert(range>0 and range<=coupling_neighbor.size()); return HoppingMatrix[range-1];}
 	
 	/**return hopping matrix*/
 	template<typename Scalar=double>
 	static vector<vector<std::pair<size_t,Scalar> > > rangeFormat (const Eigen::Array<Scalar,Dynamic,Dynamic> &hop);
 	
-	/**access x,y,atom(index)*/
-	inline tuple<int,int,std::string> operator() (int i)        const {return coord.at(i);}
+	/**access x,y,atom(index), throws std::out_of_range for an invalid index*/
+	inline tuple<int,int,std::string> operator() (int i)        const {const auto &c = coordinates(i); return make_tuple(c[0],c[1],atoms[c[2]]);}
 	
-	/**access index(x,y,atom)*/
-	inline int           operator() (int i, int j, std::string atom="") const {return index.at(make_tuple(i,j,atom));}
+	/**access index(x,y,atom), throws std::out_of_range for invalid coordinates or atoms*/
+	inline int           operator() (int i, int j, std::string atom="") const {return site(i,j,atom_id(atom));}
+	
+	/**access index(x,y,atom) with the atom given by its number in the unit cell (see atom_id)*/
+	inline int site (int ix, int iy, int atom=0) const
+	{
+		if (ix<0 or ix>=lattice_.size(0) or iy<0 or iy>=lattice_.size(1) or atom<0 or static_cast<size_t>(atom)>=atoms.size())
+		{
+			throw std::out_of_range("Geometry2D::site(): the site ("+std::to_string(ix)+","+std::to_string(iy)+","+std::to_string(atom)+") is not in the lattice.");
+		}
+		return index_table[(ix*lattice_.size(1)+iy)*atoms.size()+atom];
+	}
+	
+	/**access x,y,atom number(index)*/
+	inline const array<int,3> &coordinates (int i) const
+	{
+		if (i<0 or static_cast<size_t>(i)>=coord_table.size())
+		{
+			throw std::out_of_range("Geometry2D::coordinates(): the index "+std::to_string(i)+" is not in the lattice.");
+		}
+		return coord_table[i];
+	}
+	
+	/**number of an atom of the unit cell*/
+	inline int atom_id (const std::string &atom) const
+	{
+		auto it = std::find(atoms.begin(), atoms.end(), atom);
+		if (it == atoms.end()) {throw std::out_of_range("Geometry2D::atom_id(): the atom "+atom+" does not exist in the unit cell.");}
+		return std::distance(atoms.begin(), it);
+	}
+	
+	/**name of an atom of the unit cell*/
+	inline const std::string &atom_name (int atom) const {return atoms.at(atom);}
 	
 	/**all x coordinates at a given iy*/
 	Eigen::ArrayXd x_row (int iy) const;
@@ -60,6 +100,15 @@ public:
 	/**Coefficients for the Fourier transform in y-direction.*/
 	vector<complex<double> > FTy_phases (int ix_fixed, int iky, bool PARITY, std::string atom) const;
 
+	/**Permutation of the site indices under a translation by (dx,dy) with periodic wrap, site i is mapped to pi[i]. Generators for PermutationGroup.
+	Throws std::invalid_argument if the map does not leave the hopping matrices invariant, e.g. for open boundaries in the direction of the translation
+	or for odd dy (dx) on TRIANG_XC (TRIANG_YC), where the neighbors depend on the parity of the row (column).*/
+	Permutation translation (int dx, int dy) const;
+	
+	/**Permutation of the site indices under the reflections x -> Lx-1-x and/or y -> Ly-1-y.
+	Throws std::invalid_argument if the map does not leave the hopping matrices invariant (the single reflections on the triangular lattices).*/
+	Permutation reflection (bool REFLECT_X, bool REFLECT_Y) const;
+	
 	std::size_t numberOfBonds() const {return number_of_bonds;}
 
 	Lattice2D lattice() const {return lattice_;}
@@ -67,12 +116,23 @@ private:
 	
 	TRAVERSE2D path;
 	
-	vector<Eigen::ArrayXXd> HoppingMatrix;
+	vector<Eigen::SparseMatrix<double,Eigen::RowMajor> > HoppingMatrix;
+	
+	// atoms of the unit cell, their position in this vector is the atom number
+	vector<std::string> atoms;
+	
+	// index of (x,y,atom number) at (x*Ly+y)*atoms.size()+atom and the inverse
+	vector<int> index_table;
+	vector<array<int,3> > coord_table;
 	
-	map<tuple<int,int,std::string>,int> index;
-	map<int,tuple<int,int,std::string>> coord;
+	void fill_index();
+	void fill_HoppingMatrix();
 	
-	void fill_HoppingMatrix (size_t range=1ul);
+	/**bonds of the given range starting at the column ix*/
+	void collect_bonds (size_t range, int ix, vector<Eigen::Triplet<double> > &bonds) const;
+	
+	/**true if H(pi[i],pi[j]) == H(i,j) for all hopping matrices*/
+	bool is_symmetry (const vector<std::size_t> &pi) const;
 
 	Lattice2D lattice_;
 
@@ -86,10 +146,28 @@ Geometry2D(const Lattice2D &lattice_input, TRAVERSE2D path_input, vector<double>
 :path(path_input), coupling_neighbor(lambda), lattice_(lattice_input)
 {
 	number_of_bonds = 0ul;
+	// the unitCell of the lattice may have been changed after its construction
+	if (!lattice_.stencils_valid()) {lattice_.make_stencils();}
+	fill_index();
+	fill_HoppingMatrix();
+	number_of_bonds = static_cast<size_t>(number_of_bonds/2);
+}
+
+Geometry2D::
+Geometry2D(const Lattice2D &lattice_input, TRAVERSE2D path_input, vector<double> lambda, const vector<Eigen::SparseMatrix<double,Eigen::RowMajor> > &topology)
+:path(path_input), lattice_(lattice_input), coupling_neighbor(lambda)
+{
+	assert(topology.size() >= coupling_neighbor.size() and "The topology does not contain all requested ranges.");
+	number_of_bonds = 0ul;
+	fill_index();
+	int N = coord_table.size();
 	HoppingMatrix.resize(coupling_neighbor.size());
 	for (size_t range=0; range<coupling_neighbor.size(); range++)
 	{
-		fill_HoppingMatrix(range+1);
+		assert(topology[range].rows() == N and topology[range].cols() == N);
+		if (coupling_neighbor[range] < 1.e-8) {HoppingMatrix[range].resize(N,N); continue;}
+		HoppingMatrix[range] = coupling_neighbor[range] * topology[range];
+		number_of_bonds += HoppingMatrix[range].nonZeros();
 	}
 	number_of_bonds = static_cast<size_t>(number_of_bonds/2);
 }
@@ -128,67 +206,148 @@ Geometry2D(const Lattice2D &lattice_input, TRAVERSE2D path_input, vector<double>
 // }
 
 void Geometry2D::
-fill_HoppingMatrix (size_t range)
+fill_index()
 {
-	assert(range>0 and range<=coupling_neighbor.size());
-	
 	if (lattice_.size(0)==1) {assert(path != SNAKE and "Must use Lx>=2 with the SNAKE geometry!");}
 	
-	HoppingMatrix[range-1].resize(lattice_.volume()*lattice_.unitCell.size(),lattice_.volume()*lattice_.unitCell.size()); HoppingMatrix[range-1].setZero();
-	if (coupling_neighbor[range-1] < 1.e-8) {return;}
+	atoms.clear();
+	for (const auto &[atom,position] : lattice_.unitCell) {atoms.push_back(atom);}
+	int Ncell = atoms.size();
+	
+	index_table.resize(lattice_.volume()*Ncell);
+	coord_table.resize(lattice_.volume()*Ncell);
 	
-	// Mirrors the y coordinate to create a snake.
-	auto mirror = [this] (int iy) -> int
-	{
-		vector<int> v(lattice_.size(1));
-		std::iota (begin(v),end(v),0);
-		reverse(v.begin(),v.end());
-		return v[iy];
-	};
-
 	for (int ix=0; ix<lattice_.size(0); ++ix)
 	for (int iy=0; iy<lattice_.size(1); ++iy)
-	for (int jx=0; jx<lattice_.size(0); ++jx)
-	for (int jy=0; jy<lattice_.size(1); ++jy)
 	{
-		int countCellAtoms_i=-1;
-		for (const auto &[atom_i,position_i] : lattice_.unitCell)
+		// Mirrors the y coordinate of odd x to create a snake.
+		int iy_ = (path == SNAKE and ix%2!=0)? lattice_.size(1)-1-iy : iy;
+		for (int a=0; a<Ncell; ++a)
 		{
-			countCellAtoms_i++;
-			int countCellAtoms_j=-1;
-			for (const auto &[atom_j,position_j] : lattice_.unitCell)
-			{
-				countCellAtoms_j++;
-				int iy_=iy, jy_=jy;
-				if (path == SNAKE)
-				{
-					// mirror even y only
-					iy_ = (ix%2==0)? iy : mirror(iy);
-					jy_ = (jx%2==0)? jy : mirror(jy);
-				}
-				// the index is calculated normally:
-				int index_i = iy*lattice_.unitCell.size()+lattice_.size(1)*lattice_.unitCell.size()*ix+countCellAtoms_i;
-				int index_j = jy*lattice_.unitCell.size()+lattice_.size(1)*lattice_.unitCell.size()*jx+countCellAtoms_j;
+			// the index is calculated normally:
+			int index_i = iy*Ncell+lattice_.size(1)*Ncell*ix+a;
+			
+			// but is stored together with the mirrored y_:
+			index_table[(ix*lattice_.size(1)+iy_)*Ncell+a] = index_i;
+			coord_table[index_i] = {ix,iy_,a};
+		}
+	}
+}
+
+void Geometry2D::
+fill_HoppingMatrix()
+{
+	int N = coord_table.size();
+	int Nranges = coupling_neighbor.size();
+	HoppingMatrix.resize(Nranges);
+	vector<vector<Eigen::Triplet<double> > > bonds(Nranges);
+	
+	// all ranges and columns are distributed together, each thread collects its bonds locally
+	#ifdef _OPENMP
+	#pragma omp parallel
+	#endif
+	{
+		vector<vector<Eigen::Triplet<double> > > bonds_local(Nranges);
 		
-				// but is stored together with the mirrored y_:
-				if (jx == 0 and jy == 0)
-				{
-					index[make_tuple(ix,iy_,atom_i)] = index_i;
-					coord[index_i] = make_tuple(ix,iy_,atom_i);
-//			cout << "ix=" << ix << ", iy_=" << iy_ << ", index_i=" << index_i << endl;
-				}
-
-				if (lattice_.ARE_NEIGHBORS( {ix,iy_},{jx,jy_}, atom_i, atom_j, range))
-				{
-					HoppingMatrix[range-1](index_i,index_j) += coupling_neighbor[range-1];
-					number_of_bonds++;
-				}
-			}
+		#ifdef _OPENMP
+		#pragma omp for collapse(2) schedule(dynamic) nowait
+		#endif
+		for (int range=0; range<Nranges; ++range)
+		for (int ix=0; ix<lattice_.size(0); ++ix)
+		{
+			collect_bonds(range+1, ix, bonds_local[range]);
+		}
+		
+		#ifdef _OPENMP
+		#pragma omp critical
+		#endif
+		for (int range=0; range<Nranges; ++range)
+		{
+			bonds[range].insert(bonds[range].end(), bonds_local[range].begin(), bonds_local[range].end());
 		}
 	}
+	
+	#ifdef _OPENMP
+	#pragma omp parallel for
+	#endif
+	for (int range=0; range<Nranges; ++range)
+	{
+		HoppingMatrix[range].resize(N,N);
+		HoppingMatrix[range].setFromTriplets(bonds[range].begin(), bonds[range].end());
+	}
+	
+	for (int range=0; range<Nranges; ++range) {number_of_bonds += bonds[range].size();}
 	assert(number_of_bonds%2 == 0);
 }
 
+void Geometry2D::
+collect_bonds (size_t range, int ix, vector<Eigen::Triplet<double> > &bonds) const
+{
+	assert(range>0 and range<=coupling_neighbor.size());
+	if (coupling_neighbor[range-1] < 1.e-8) {return;}
+	
+	for (size_t a=0; a<atoms.size(); ++a)
+	for (size_t b=0; b<atoms.size(); ++b)
+	{
+		const Lattice2D::Stencil &s = lattice_.stencil(atoms[a], atoms[b], range);
+		
+		for (int iy=0; iy<lattice_.size(1); ++iy)
+		{
+			int index_i = site(ix,iy,a);
+			for (const auto &j : lattice_.apply_stencil(Lattice2D::IndexSite(ix,iy), s))
+			{
+				bonds.push_back(Eigen::Triplet<double>(index_i, site(j[0],j[1],b), coupling_neighbor[range-1]));
+			}
+		}
+	}
+}
+
+Permutation Geometry2D::
+translation (int dx, int dy) const
+{
+	int Lx = lattice_.size(0);
+	int Ly = lattice_.size(1);
+	vector<std::size_t> out(coord_table.size());
+	for (std::size_t i=0; i<coord_table.size(); ++i)
+	{
+		const auto &[x,y,a] = coord_table[i];
+		out[i] = site(((x+dx)%Lx+Lx)%Lx, ((y+dy)%Ly+Ly)%Ly, a);
+	}
+	if (!is_symmetry(out))
+	{
+		throw std::invalid_argument("Geometry2D::translation(): ("+std::to_string(dx)+","+std::to_string(dy)+") is not a symmetry of the lattice.");
+	}
+	return Permutation(out);
+}
+
+Permutation Geometry2D::
+reflection (bool REFLECT_X, bool REFLECT_Y) const
+{
+	vector<std::size_t> out(coord_table.size());
+	for (std::size_t i=0; i<coord_table.size(); ++i)
+	{
+		const auto &[x,y,a] = coord_table[i];
+		out[i] = site((REFLECT_X)? lattice_.size(0)-1-x : x, (REFLECT_Y)? lattice_.size(1)-1-y : y, a);
+	}
+	if (!is_symmetry(out))
+	{
+		throw std::invalid_argument("Geometry2D::reflection(): the reflection is not a symmetry of the lattice.");
+	}
+	return Permutation(out);
+}
+
+bool Geometry2D::
+is_symmetry (const vector<std::size_t> &pi) const
+{
+	for (const auto &H : HoppingMatrix)
+	for (int i=0; i<H.outerSize(); ++i)
+	for (Eigen::SparseMatrix<double,Eigen::RowMajor>::InnerIterator it(H,i); it; ++it)
+	{
+		if (std::abs(H.coeff(pi[i],pi[it.col()])-it.value()) > ::mynumeric_limits<double>::epsilon()) {return false;}
+	}
+	return true;
+}
+
 template<typename Scalar>
 vector<vector<std::pair<size_t,Scalar> > > Geometry2D::
 rangeFormat (const Eigen::Array<Scalar,Dynamic,Dynamic> &hop)
@@ -212,9 +371,9 @@ x_row (int iy) const
 {
 	Eigen::ArrayXd out(lattice_.size(0)*lattice_.unitCell.size());
 	for (int ix=0; ix<lattice_.size(0); ++ix)
-	for (const auto &[atom,position]: lattice_.unitCell)
+	for (size_t a=0; a<atoms.size(); ++a)
 	{
-		out(ix) = index.at(make_tuple(ix,iy,atom));
+		out(ix) = site(ix,iy,a);
 	}
 	return out;
 }
@@ -233,9 +392,10 @@ FTy_phases (int x, int iky, bool PARITY, std::string atom="") const
 	
 //	cout << "iky=" << iky << ", ky=" << ky << endl;
 	
+	int a = atom_id(atom);
 	for (int y=0; y<lattice_.size(1); ++y)
 	{
-		int i = index.at(make_tuple(x,y,atom));
+		int i = site(x,y,a);
 		
 		out[i] = exp(sign*1.i*ky*static_cast<double>(y)) / sqrt(lattice_.size(1));
 		
@@ -0,0 +1,249 @@
+#ifndef GEOMETRYCACHE
+#define GEOMETRYCACHE
+
+#include <array>
+#include <chrono>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <future>
+#include <tuple>
+
+#include "Geometry2D.h"
+
+#ifdef GEOMETRYCACHE_WITH_HDF5
+#include "HDF5Interface.h"
+#endif
+
+/**Process-wide, thread-safe cache of the neighbor topology of Geometry2D (the hopping matrices for unit couplings).
+The topology is computed once per key (Lx, Ly, PERIODIC, LatticeType, TRAVERSE2D path, number of ranges, lattice vectors and unitCell)
+and then only scaled by the couplings λ. Topologies for different keys are built in parallel, requests for a key that is being built wait for it.
+Compile with -DGEOMETRYCACHE_WITH_HDF5 to save and load the cache with HDF5Interface.*/
+class GeometryCache
+{
+public:
+	
+	typedef vector<Eigen::SparseMatrix<double,Eigen::RowMajor> > Topology;
+	
+	/**atoms of the unitCell with their positions, in the order of the atom numbers of Geometry2D*/
+	typedef vector<std::pair<std::string,std::array<double,2> > > Cell;
+	
+	/**Lx, Ly, PERIODIC_x, PERIODIC_y, LatticeType, path, number of ranges, lattice vectors a[0] and a[1], unitCell*/
+	typedef std::tuple<int,int,bool,bool,LatticeType,TRAVERSE2D,size_t,std::array<double,4>,Cell> Key;
+	
+	/**the cache of the process*/
+	static GeometryCache &instance();
+	
+	/**Returns the geometry with the couplings \p lambda, computing the topology only if it is not cached yet.*/
+	Geometry2D get (const Lattice2D &lattice, TRAVERSE2D path, vector<double> lambda={1.});
+	
+	/**Returns the cached topology for \p ranges ranges, computing it if necessary.*/
+	std::shared_ptr<const Topology> topology (const Lattice2D &lattice, TRAVERSE2D path, size_t ranges);
+	
+	std::size_t size() const;
+	void clear();
+	
+	#ifdef GEOMETRYCACHE_WITH_HDF5
+	/**Saves all cached topologies.*/
+	void save (std::string filename) const;
+	
+	/**Adds all topologies from a file saved with save().*/
+	void load (std::string filename);
+	#endif
+	
+private:
+	
+	GeometryCache() {};
+	GeometryCache (const GeometryCache&) = delete;
+	GeometryCache &operator= (const GeometryCache&) = delete;
+	
+	static Key make_key (const Lattice2D &lattice, TRAVERSE2D path, size_t ranges);
+	
+	// only held to look up and insert, the topologies are built outside of it
+	mutable std::mutex mtx;
+	std::map<Key,std::shared_future<std::shared_ptr<const Topology> > > cache;
+};
+
+GeometryCache &GeometryCache::
+instance()
+{
+	static GeometryCache out;
+	return out;
+}
+
+GeometryCache::Key GeometryCache::
+make_key (const Lattice2D &lattice, TRAVERSE2D path, size_t ranges)
+{
+	std::array<double,4> vectors = {lattice.a[0](0), lattice.a[0](1), lattice.a[1](0), lattice.a[1](1)};
+	Cell cell;
+	// same order as Geometry2D::fill_index()
+	for (const auto &[atom,position] : lattice.unitCell) {cell.push_back(std::make_pair(atom, std::array<double,2>{position(0), position(1)}));}
+	return std::make_tuple(lattice.size(0), lattice.size(1), lattice.periodic(0), lattice.periodic(1), lattice.type(), path, ranges, vectors, cell);
+}
+
+std::shared_ptr<const GeometryCache::Topology> GeometryCache::
+topology (const Lattice2D &lattice, TRAVERSE2D path, size_t ranges)
+{
+	Key key = make_key(lattice, path, ranges);
+	
+	// The first request for a key inserts a future and builds the topology, concurrent requests for the same key wait for it.
+	std::promise<std::shared_ptr<const Topology> > promise;
+	std::shared_future<std::shared_ptr<const Topology> > result;
+	bool BUILD = false;
+	{
+		std::lock_guard<std::mutex> lock(mtx);
+		auto it = cache.find(key);
+		if (it != cache.end()) {result = it->second;}
+		else {result = cache[key] = promise.get_future().share(); BUILD = true;}
+	}
+	
+	if (BUILD)
+	{
+		try
+		{
+			Geometry2D unit(lattice, path, vector<double>(ranges,1.));
+			auto out = std::make_shared<Topology>(ranges);
+			for (size_t range=0; range<ranges; ++range)
+			{
+				(*out)[range] = unit.hoppingSparse(range+1);
+			}
+			promise.set_value(out);
+		}
+		catch (...)
+		{
+			// the waiting requests get the exception, later ones try again
+			{
+				std::lock_guard<std::mutex> lock(mtx);
+				cache.erase(key);
+			}
+			promise.set_exception(std::current_exception());
+		}
+	}
+	return result.get();
+}
+
+Geometry2D GeometryCache::
+get (const Lattice2D &lattice, TRAVERSE2D path, vector<double> lambda)
+{
+	return Geometry2D(lattice, path, lambda, *topology(lattice, path, lambda.size()));
+}
+
+std::size_t GeometryCache::
+size() const
+{
+	std::lock_guard<std::mutex> lock(mtx);
+	return cache.size();
+}
+
+void GeometryCache::
+clear()
+{
+	std::lock_guard<std::mutex> lock(mtx);
+	cache.clear();
+}
+
+#ifdef GEOMETRYCACHE_WITH_HDF5
+void GeometryCache::
+save (std::string filename) const
+{
+	std::lock_guard<std::mutex> lock(mtx);
+	HDF5Interface target(filename, WRITE);
+	
+	size_t count = 0;
+	for (const auto &[key,result] : cache)
+	{
+		// topologies still being built are skipped
+		if (result.wait_for(std::chrono::seconds(0)) != std::future_status::ready) {continue;}
+		const auto &topo = result.get();
+		
+		std::string grp = "geometry" + std::to_string(count);
+		target.create_group(grp);
+		target.save_scalar<int>(std::get<0>(key), "Lx", grp);
+		target.save_scalar<int>(std::get<1>(key), "Ly", grp);
+		target.save_scalar<int>(std::get<2>(key), "PERIODIC_x", grp);
+		target.save_scalar<int>(std::get<3>(key), "PERIODIC_y", grp);
+		target.save_scalar<int>(std::get<4>(key), "type", grp);
+		target.save_scalar<int>(std::get<5>(key), "path", grp);
+		target.save_scalar<int>(std::get<6>(key), "ranges", grp);
+		target.save_scalar<int>((topo->size()>0)? (*topo)[0].rows() : 0, "N", grp);
+		const auto &vectors = std::get<7>(key);
+		Eigen::MatrixXd a(2,2);
+		a << vectors[0], vectors[1], vectors[2], vectors[3];
+		target.save_matrix(a, "a", grp);
+		const Cell &cell = std::get<8>(key);
+		Eigen::MatrixXd positions(cell.size(),2);
+		target.save_scalar<int>(cell.size(), "Natoms", grp);
+		for (size_t k=0; k<cell.size(); ++k)
+		{
+			// the names are prefixed, since the default atom is the empty string
+			target.save_char("atom:"+cell[k].first, "atom"+std::to_string(k), grp);
+			positions(k,0) = cell[k].second[0];
+			positions(k,1) = cell[k].second[1];
+		}
+		target.save_matrix(positions, "positions", grp);
+		
+		// CSR arrays, the values are all 1
+		for (size_t range=0; range<topo->size(); ++range)
+		{
+			const auto &M = (*topo)[range];
+			Eigen::VectorXi outer = Eigen::Map<const Eigen::VectorXi>(M.outerIndexPtr(), M.outerSize()+1);
+			Eigen::VectorXi inner = Eigen::Map<const Eigen::VectorXi>(M.innerIndexPtr(), M.nonZeros());
+			target.save_vector(outer, "outer"+std::to_string(range+1), grp);
+			target.save_vector(inner, "inner"+std::to_string(range+1), grp);
+		}
+		++count;
+	}
+	target.close();
+}
+
+void GeometryCache::
+load (std::string filename)
+{
+	HDF5Interface source(filename, READ);
+	
+	for (const auto &grp : source.get_groups())
+	{
+		int Lx, Ly, PERIODIC_x, PERIODIC_y, type, path, ranges, N;
+		source.load_scalar(Lx, "Lx", grp);
+		source.load_scalar(Ly, "Ly", grp);
+		source.load_scalar(PERIODIC_x, "PERIODIC_x", grp);
+		source.load_scalar(PERIODIC_y, "PERIODIC_y", grp);
+		source.load_scalar(type, "type", grp);
+		source.load_scalar(path, "path", grp);
+		source.load_scalar(ranges, "ranges", grp);
+		source.load_scalar(N, "N", grp);
+		Eigen::MatrixXd a, positions;
+		source.load_matrix(a, "a", grp);
+		source.load_matrix(positions, "positions", grp);
+		int Natoms;
+		source.load_scalar(Natoms, "Natoms", grp);
+		Cell cell(Natoms);
+		for (int k=0; k<Natoms; ++k)
+		{
+			std::string atom;
+			source.load_char(atom, "atom"+std::to_string(k), grp);
+			cell[k] = std::make_pair(atom.substr(5), std::array<double,2>{positions(k,0), positions(k,1)});
+		}
+		
+		auto topo = std::make_shared<Topology>(ranges);
+		for (int range=0; range<ranges; ++range)
+		{
+			Eigen::VectorXi outer, inner;
+			source.load_vector(outer, "outer"+std::to_string(range+1), grp);
+			source.load_vector(inner, "inner"+std::to_string(range+1), grp);
+			Eigen::VectorXd values = Eigen::VectorXd::Ones(inner.rows());
+			(*topo)[range] = Eigen::Map<const Eigen::SparseMatrix<double,Eigen::RowMajor> >(N, N, inner.rows(), outer.data(), inner.data(), values.data());
+		}
+		
+		Key key = std::make_tuple(Lx, Ly, static_cast<bool>(PERIODIC_x), static_cast<bool>(PERIODIC_y), static_cast<LatticeType>(type), static_cast<TRAVERSE2D>(path), static_cast<size_t>(ranges),
+		                          std::array<double,4>{a(0,0), a(0,1), a(1,0), a(1,1)}, cell);
+		std::promise<std::shared_ptr<const Topology> > loaded;
+		loaded.set_value(topo);
+		std::lock_guard<std::mutex> lock(mtx);
+		cache[key] = loaded.get_future().share();
+	}
+	source.close();
+}
+#endif
+
+#endif
@@ -2,6 +2,11 @@
 #define LATTICE
 
 #include <array>
+#include <algorithm>
+#include <map>
+#include <tuple>
+#include <stdexcept>
+#include <unordered_map>
 #include <Eigen/Dense>
 
 #include "numeric_limits.h"
@@ -42,11 +47,34 @@ public:
 		int& operator[] ( std::size_t index ) {return i[index];}
 	};
 
+	/**Integer displacements d, such that the site j=i+d is a neighbor of the site i, separately for both parity classes of i.*/
+	typedef array<std::vector<IndexSite>,2> Stencil;
+	
 	bool ARE_NEIGHBORS(IndexSite i, IndexSite j, std::string atom_i, std::string atom_j, size_t range=1) const;
+	
+	/**Returns the precomputed displacement stencil from \p atom_i to \p atom_j for a given \p range.
+	Throws std::logic_error if the unitCell was changed after the last make_stencils().*/
+	const Stencil &stencil(std::string atom_i, std::string atom_j, size_t range=1) const;
+	
+	/**Computes the displacement stencil from \p atom_i to \p atom_j for all distances 0 < d <= \p max_distance (for longer-range couplings).*/
+	Stencil stencil_within(std::string atom_i, std::string atom_j, double max_distance) const;
+	
+	/**Precomputes the stencils of all atom pairs and ranges. Has to be called again if the unitCell is changed after construction.*/
+	void make_stencils();
+	
+	/**True if the stencils were computed for the current unitCell.*/
+	bool stencils_valid() const {return stencil_cell == unitCell;}
+	
+	/**Applies the stencil to the site \p i and returns all sites of the lattice reached by it (including the periodic images), sorted in x, then y.*/
+	std::vector<IndexSite> apply_stencil(IndexSite i, const Stencil &s) const;
+	
+	/**Parity class of a site. The distance between two sites only depends on their displacement and on this class (relevant for TRIANG_XC and TRIANG_YC).*/
+	int parity(const IndexSite &i) const;
 
 	std::vector<pair<IndexSite,std::string> > neighbors(IndexSite i, std::string atom_i, size_t range=1) const;
 	
 	int size(int d) const {return L[d];}
+	bool periodic(int d) const {return PERIODIC[d];}
 	int volume() const { int out=1; for (const auto Li:L) {out*=Li;} return out; }
 
 	std::string name() const {return name_;}
@@ -76,6 +104,11 @@ protected:
 	Eigen::Matrix<double,dim,1> origin;
 
 	vector<double> neighbor_distance;
+	
+	std::map<std::tuple<std::string,std::string,size_t>,Stencil> stencils;
+	std::unordered_map<std::string,Eigen::Matrix<double,dim,1> > stencil_cell; // unitCell the stencils were computed for
+	
+	template<typename Predicate> Stencil make_stencil(std::string atom_i, std::string atom_j, double max_distance, Predicate IS_IN_STENCIL) const;
 
 	array<bool,dim> PERIODIC;
 
@@ -132,6 +165,8 @@ Lattice2D(array<size_t,2> L_input, array<bool,2> PERIODIC_input, LatticeType typ
 	assert(abs(a[1].dot(b[1])-2*M_PI) <1.e-12);
 	assert(abs(a[0].dot(b[1])) <1.e-12);
 	assert(abs(a[1].dot(b[0])) <1.e-12);
+	
+	make_stencils();
 }
 
 Eigen::Matrix<double,2,1> Lattice2D::
@@ -154,6 +189,102 @@ getSite(const IndexSite& i) const
 	return out;
 }
 
+int Lattice2D::
+parity(const IndexSite &i) const
+{
+	if      (type_ == LatticeType::TRIANG_XC) {return ((i[1]%2)+2)%2;}
+	else if (type_ == LatticeType::TRIANG_YC) {return ((i[0]%2)+2)%2;}
+	return 0;
+}
+
+template<typename Predicate>
+Lattice2D::Stencil Lattice2D::
+make_stencil(std::string atom_i, std::string atom_j, double max_distance, Predicate IS_IN_STENCIL) const
+{
+	auto it_i = unitCell.find(atom_i);
+	auto it_j = unitCell.find(atom_j);
+	assert(it_i != unitCell.end() and it_j != unitCell.end() and "You specified an atom in the unit cell which does not exist.");
+	
+	Stencil out;
+	// the shortest lattice vector component is sqrt(3)/2, so this covers all displacements within the distance
+	int reach = static_cast<int>(std::ceil(2.*(max_distance+(it_i->second-it_j->second).norm())))+2;
+	for (int p=0; p<2; ++p)
+	{
+		IndexSite i = (type_ == LatticeType::TRIANG_YC)? IndexSite(p,0) : IndexSite(0,p);
+		Eigen::Matrix<double,dim,1> Ri = getSite(i) + it_i->second;
+		for (int dx=-reach; dx<=reach; ++dx)
+		for (int dy=-reach; dy<=reach; ++dy)
+		{
+			Eigen::Matrix<double,dim,1> Rj = getSite(i[0]+dx,i[1]+dy) + it_j->second;
+			if (IS_IN_STENCIL((Ri - Rj).norm())) {out[p].push_back(IndexSite(dx,dy));}
+		}
+	}
+	return out;
+}
+
+void Lattice2D::
+make_stencils()
+{
+	stencils.clear();
+	stencil_cell = unitCell;
+	for (const auto &[atom_i,position_i] : unitCell)
+	for (const auto &[atom_j,position_j] : unitCell)
+	for (size_t range=1; range<=neighbor_distance.size(); ++range)
+	{
+		double d = neighbor_distance[range-1];
+		stencils[std::make_tuple(atom_i,atom_j,range)] = make_stencil(atom_i, atom_j, d, [d] (double distance)
+		{
+			return abs(distance-d) < mynumeric_limits<double>::epsilon();
+		});
+	}
+}
+
+const Lattice2D::Stencil &Lattice2D::
+stencil(std::string atom_i, std::string atom_j, size_t range) const
+{
+	assert(range <= neighbor_distance.size() and range > 0);
+	if (!stencils_valid()) {throw std::logic_error("Lattice2D::stencil(): the unitCell was changed, call make_stencils() first.");}
+	auto it = stencils.find(std::make_tuple(atom_i,atom_j,range));
+	if (it == stencils.end()) {throw std::out_of_range("Lattice2D::stencil(): the atom "+atom_i+" or "+atom_j+" does not exist in the unit cell.");}
+	return it->second;
+}
+
+Lattice2D::Stencil Lattice2D::
+stencil_within(std::string atom_i, std::string atom_j, double max_distance) const
+{
+	return make_stencil(atom_i, atom_j, max_distance, [max_distance] (double distance)
+	{
+		return distance > mynumeric_limits<double>::epsilon() and distance < max_distance+mynumeric_limits<double>::epsilon();
+	});
+}
+
+std::vector<Lattice2D::IndexSite> Lattice2D::
+apply_stencil(IndexSite i, const Stencil &s) const
+{
+	// periodic images of i, the same ones as checked in ARE_NEIGHBORS
+	std::vector<int> shifts_x = {0};
+	std::vector<int> shifts_y = {0};
+	if (PERIODIC[0] and L[0] > 2) {shifts_x.push_back(static_cast<int>(L[0])); shifts_x.push_back(-static_cast<int>(L[0]));}
+	if (PERIODIC[1] and L[1] > 2) {shifts_y.push_back(static_cast<int>(L[1])); shifts_y.push_back(-static_cast<int>(L[1]));}
+	
+	std::vector<IndexSite> out;
+	for (const auto &sx : shifts_x)
+	for (const auto &sy : shifts_y)
+	{
+		IndexSite i_shift(i[0]+sx,i[1]+sy);
+		for (const auto &d : s[parity(i_shift)])
+		{
+			IndexSite j(i_shift[0]+d[0],i_shift[1]+d[1]);
+			if (j[0] >= 0 and j[0] < size(0) and j[1] >= 0 and j[1] < size(1)) {out.push_back(j);}
+		}
+	}
+	
+	// several images may reach the same site on small lattices
+	std::sort(out.begin(), out.end(), [] (const IndexSite &a, const IndexSite &b) {return a.i < b.i;});
+	out.erase(std::unique(out.begin(), out.end(), [] (const IndexSite &a, const IndexSite &b) {return a.i == b.i;}), out.end());
+	return out;
+}
+
 std::vector<pair<Lattice2D::IndexSite,std::string> > Lattice2D::
 neighbors(IndexSite i, std::string atom_i="", size_t range) const
 {
@@ -161,13 +292,12 @@ neighbors(IndexSite i, std::string atom_i="", size_t range) const
 	assert(range <= neighbor_distance.size() and range > 0);
 	auto it_i = unitCell.find(atom_i);
 	assert(it_i != unitCell.end() and "You specified an atom in the unit cell which does not exist.");
-	for (int jx=0; jx<size(0); ++jx)
-	for (int jy=0; jy<size(1); ++jy)
 	for (const auto &[atom_j,position_j] : unitCell)
 	{
-		IndexSite j(jx,jy);
-		if (ARE_NEIGHBORS(i,j,atom_i,atom_j,range)) {out.push_back(std::make_pair(j,atom_j));}
+		for (const auto &j : apply_stencil(i, stencil(atom_i,atom_j,range))) {out.push_back(std::make_pair(j,atom_j));}
 	}
+	// same ordering as a scan over all sites: x, then y, then the atoms
+	std::stable_sort(out.begin(), out.end(), [] (const pair<IndexSite,std::string> &a, const pair<IndexSite,std::string> &b) {return a.first.i < b.first.i;});
 	return out;
 }
 
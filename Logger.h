@@ -4,14 +4,113 @@
 #include <ctime>
 #include <iostream>
 #include <fstream>
+#include <sstream>
+#include <vector>
+#include <chrono>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <atomic>
+#include <algorithm>
+#include <deque>
+#include <list>
+#include <memory>
+#include <map>
+#include <cstdio>
+#include <cstdint>
+#include <initializer_list>
+#include <stdexcept>
+
+#ifdef LOGGER_WITH_ZLIB
+#include <zlib.h>
+#endif
 
 #include "ArgParser.h"
 #include "StringStuff.h"
 
+/**Lock-free multi-producer single-consumer queue (D. Vyukov). push() is one atomic exchange, pop() is only called by the consumer.*/
+template<typename T>
+class MpscQueue
+{
+public:
+	
+	MpscQueue() : head(new Node()), tail(head.load()) {};
+	
+	~MpscQueue()
+	{
+		T dummy;
+		while (pop(dummy)) {}
+		delete tail;
+	}
+	
+	MpscQueue (const MpscQueue&) = delete;
+	MpscQueue &operator= (const MpscQueue&) = delete;
+	
+	void push (T &&value)
+	{
+		Node *n = new Node(std::move(value));
+		Node *prev = head.exchange(n, std::memory_order_acq_rel);
+		prev->next.store(n, std::memory_order_release);
+	}
+	
+	/**Returns false if the queue is empty or a producer has not finished linking its node yet.*/
+	bool pop (T &value)
+	{
+		Node *next = tail->next.load(std::memory_order_acquire);
+		if (next == nullptr) {return false;}
+		value = std::move(next->value);
+		delete tail;
+		tail = next;
+		return true;
+	}
+	
+private:
+	
+	struct Node
+	{
+		Node() {};
+		Node (T &&value_input) : value(std::move(value_input)) {};
+		T value;
+		std::atomic<Node*> next{nullptr};
+	};
+	
+	std::atomic<Node*> head;
+	Node *tail;
+};
+
 class Logger
 {
 	typedef std::string string;
+	
+	/**One finished line together with the thread and the time it was logged from.*/
+	struct Entry
+	{
+		string text;
+		int thread_id = 0;
+		std::chrono::system_clock::time_point time;
+	};
+	
+	/**One typed record, the field names are given by the schema.*/
+	struct Record
+	{
+		std::uint32_t schema;
+		std::uint32_t thread_id;
+		std::int64_t time;
+		std::vector<double> values;
+	};
+	
 public:
+	
+	/**All records of one key read back from a record file, one row per record.*/
+	struct RecordTable
+	{
+		std::vector<string> fields;
+		std::vector<std::int64_t> time; // nanoseconds since epoch
+		std::vector<int> thread_id;
+		std::vector<std::vector<double> > rows;
+	};
+	
+	static constexpr std::uint64_t RECORD_MAGIC = 0x534345525352524cull; // "LRRSRECS" in little endian
 
 	Logger (){};
 	
@@ -25,6 +124,9 @@ public:
 	
 	~Logger();
 	
+	Logger (const Logger&) = delete;
+	Logger &operator= (const Logger&) = delete;
+	
 	void set (string filename_input, string subfolder, bool APPEND_TIME_TO_FILENAME = false);
 	void append();
 	void write();
@@ -33,20 +135,124 @@ public:
 		APPEND = APPEND_IN; SHOW_START_TIME = SHOW_START_TIME_IN; SHOW_END_TIME = SHOW_END_TIME_IN;
 	}
 	
+	/**Finished lines are queued and written to the open logfile by a background thread,
+	at the latest after \p interval or as soon as \p level lines are waiting. If \p capacity lines are waiting, append() waits for the writer.*/
+	void set_flush (std::chrono::milliseconds interval, std::size_t level=256, std::size_t capacity_input=4096);
+	
+	/**Writes all buffered lines to the logfile and flushes it.*/
+	void flush();
+	
+	/**Declares a record type \p key with numeric \p fields and returns its id for record().
+	The records are written in binary to the logfile with the ending .rec instead of .log.*/
+	std::uint32_t define_record (const string &key, const std::vector<string> &fields);
+	
+	/**Logs one record of the type \p schema. The values are not formatted, they are written as raw doubles.
+	Throws std::invalid_argument if \p schema is not defined or the number of values does not match its fields.*/
+	void record (std::uint32_t schema, std::initializer_list<double> values);
+	
+	/**Reads a record file written by a Logger, sorted by key.
+	Throws std::runtime_error if the file cannot be opened or is not a record file.*/
+	static std::map<string,RecordTable> read_records (const string &recfilename);
+	
+	/**Prefixes every line in the logfile with the time and the id of the logging thread.*/
+	void set_stamps (bool STAMPS_IN) {std::lock_guard<std::mutex> file_lock(file_mtx); STAMPS = STAMPS_IN;}
+	
 	// std::endl is a function template:
 	Logger &operator<< (std::ostream& (*f)(std::ostream&));
 	
+	/**The line under construction of the thread that created the Logger.*/
 	std::stringstream stream;
 	
-	string get_history() const {return history;};
+	/**The line under construction of the calling thread: stream for the thread that created the Logger, a separate one for every other thread,
+	so that lines from different threads do not mix in the logfile.*/
+	std::stringstream &line();
+	
+	/**Small sequential id of the calling thread, 0 for the first thread that logs.*/
+	static int thread_id();
+	
+	string get_history();
+	
+	/**Keeps only the last \p max_lines lines and at most \p max_bytes bytes in the history (0 means no limit), older lines are dropped right away.
+	By default it keeps the last 1 MiB.*/
+	void set_history (std::size_t max_lines, std::size_t max_bytes=1ul<<20);
+	
+	/**Starts a new logfile when the current one exceeds \p max_bytes or is older than \p max_age (0 means never).
+	The old segments are kept as filename.1, filename.2,... up to \p keep and compressed to filename.k.gz if \p COMPRESS is set
+	(requires LOGGER_WITH_ZLIB).*/
+	void set_rotation (std::size_t max_bytes, std::chrono::seconds max_age=std::chrono::seconds(0), std::size_t keep=5, bool COMPRESS=false);
 	
 private:
 	
 	void construct();
 	
+	void start_writer();
+	void stop_writer();
+	void writer_loop();
+	void drain (bool BLOCK=true);
+	void open_logfile (std::ios_base::openmode mode);
+	void rotate();
+	string segment_name (std::size_t k) const;
+	
+	string format (const Entry &entry) const;
+	void trim_history();
+	void wait_for_space();
+	void open_recfile();
+	void write_definition (std::uint32_t schema);
+	void enqueue (string &&text);
+	static std::uint64_t next_serial();
+	
+	// binary i/o of the record file, strings are prefixed with their length
+	template<typename T> static void write_raw (std::ofstream &file, const T &x);
+	static void write_raw (std::ofstream &file, const string &s);
+	template<typename T> static bool read_raw (std::ifstream &file, T &x);
+	static bool read_raw (std::ifstream &file, string &s);
+	
+	// record types, only changed under file_mtx
+	std::vector<std::pair<string,std::vector<string> > > schemas;
+	// number of fields per record type for the check in record(), published without a lock: define_record() replaces it by a longer copy
+	// and keeps the old versions in field_count_versions, since record() may still be reading them
+	std::atomic<const std::vector<std::size_t>*> field_counts{nullptr};
+	std::vector<std::unique_ptr<const std::vector<std::size_t> > > field_count_versions;
+	std::ofstream recfile;
+	MpscQueue<Record> records;
+	
 	string filename;
 	
-	string history = "";
+	std::ofstream logfile;
+	
+	// lines and records waiting for the writer, pending is incremented before the push and decremented after the pop
+	MpscQueue<Entry> queue;
+	std::atomic<std::size_t> pending{0};
+	std::atomic<std::size_t> capacity{4096};
+	
+	std::chrono::milliseconds flush_interval = std::chrono::milliseconds(1000);
+	std::atomic<std::size_t> flush_level{256};
+	
+	std::mutex wake_mtx;
+	std::mutex file_mtx;
+	std::condition_variable cv_writer;
+	std::condition_variable cv_space;
+	std::thread writer;
+	bool STOP = false;
+	bool STAMPS = false;
+	
+	// the lines under construction of all threads except the owner are kept thread_local, see line()
+	std::thread::id owner = std::this_thread::get_id();
+	const std::uint64_t serial_ = next_serial();
+	std::shared_ptr<const bool> alive = std::make_shared<const bool>(true);
+	
+	// only touched by the consumer, i.e. inside drain()
+	std::deque<string> history;
+	std::size_t history_bytes = 0;
+	std::size_t history_max_lines = 0;
+	std::size_t history_max_bytes = 1ul<<20;
+	
+	std::size_t rotate_bytes = 0;
+	std::chrono::seconds rotate_age = std::chrono::seconds(0);
+	std::size_t rotate_keep = 5;
+	bool COMPRESS_SEGMENTS = false;
+	std::size_t file_bytes = 0;
+	std::chrono::steady_clock::time_point file_opened;
 	
 	bool SHOW_START_TIME = true;
 	bool SHOW_END_TIME = true;
@@ -121,14 +327,18 @@ set (string filename_input, string subfolder_input, bool APPEND_TIME_TO_FILENAME
 void Logger::
 construct()
 {
-//	logfile.open(filename);
+	stop_writer();
+	open_logfile((APPEND)? std::ios_base::app : std::ios_base::trunc);
+	if (recfile.is_open()) {recfile.close();}
+	if (schemas.size() > 0) {open_recfile();}
+	start_writer();
+	
 	if (SHOW_START_TIME)
 	{
 		time_t now = time(NULL);
-		stream << asctime(localtime(&now)) << "\n";
+		line() << asctime(localtime(&now)) << "\n";
 	}
-	if (APPEND) {append();}
-	else {write();}
+	append();
 }
 
 Logger::
@@ -137,65 +347,488 @@ Logger::
 	if(SHOW_END_TIME)
 	{
 		time_t now = time(NULL);
-		stream << "\n" << asctime(localtime(&now));
+		line() << "\n" << asctime(localtime(&now));
 	}
 	append();
-//	logfile.close();
+	stop_writer();
 }
 
 void Logger::
-append()
+set_flush (std::chrono::milliseconds interval, std::size_t level, std::size_t capacity_input)
+{
+	assert(level > 0 and level <= capacity_input);
+	std::lock_guard<std::mutex> lock(wake_mtx);
+	flush_interval = interval;
+	flush_level = level;
+	capacity = capacity_input;
+	cv_space.notify_all();
+}
+
+void Logger::
+start_writer()
+{
+	if (!logfile.is_open()) {return;}
+	STOP = false;
+	writer = std::thread(&Logger::writer_loop, this);
+}
+
+void Logger::
+stop_writer()
+{
+	if (writer.joinable())
+	{
+		{
+			std::lock_guard<std::mutex> lock(wake_mtx);
+			STOP = true;
+		}
+		cv_writer.notify_one();
+		cv_space.notify_all();
+		writer.join();
+	}
+	if (logfile.is_open()) {logfile.close();}
+}
+
+void Logger::
+writer_loop()
+{
+	std::unique_lock<std::mutex> lock(wake_mtx);
+	while (true)
+	{
+		// Producers notify without taking wake_mtx, a lost wake-up only delays the write until the next interval.
+		cv_writer.wait_for(lock, flush_interval, [this] {return STOP or pending.load(std::memory_order_relaxed) >= flush_level;});
+		bool LAST = STOP;
+		lock.unlock();
+		drain();
+		lock.lock();
+		if (LAST and pending.load() == 0) {break;}
+	}
+}
+
+void Logger::
+drain (bool BLOCK)
+{
+	// file_mtx makes the caller the single consumer of the queue
+	std::unique_lock<std::mutex> file_lock(file_mtx, std::defer_lock);
+	if (BLOCK) {file_lock.lock();}
+	else if (!file_lock.try_lock()) {return;}
+	
+	Entry entry;
+	bool WRITTEN = false;
+	std::size_t popped = 0;
+	while (queue.pop(entry))
+	{
+		pending.fetch_sub(1, std::memory_order_relaxed);
+		++popped;
+		string line = remove_termcolor(entry.text);
+		
+		history_bytes += line.size();
+		history.push_back(line);
+		trim_history();
+		
+		if (!logfile.is_open()) {continue;}
+		if (STAMPS) {line = format(entry)+line;}
+		
+		bool TOO_BIG = rotate_bytes > 0 and file_bytes+line.size() > rotate_bytes;
+		bool TOO_OLD = rotate_age.count() > 0 and std::chrono::steady_clock::now()-file_opened > rotate_age;
+		if (file_bytes > 0 and (TOO_BIG or TOO_OLD)) {rotate();}
+		logfile << line;
+		file_bytes += line.size();
+		WRITTEN = true;
+	}
+	if (WRITTEN) {logfile.flush();}
+	
+	Record rec;
+	bool RECORDED = false;
+	while (records.pop(rec))
+	{
+		pending.fetch_sub(1, std::memory_order_relaxed);
+		++popped;
+		if (!recfile.is_open()) {continue;}
+		assert(rec.schema < schemas.size() and rec.values.size() == schemas[rec.schema].second.size() and "Record does not match its definition.");
+		write_raw(recfile, std::uint32_t(1));
+		write_raw(recfile, rec.schema);
+		write_raw(recfile, rec.thread_id);
+		write_raw(recfile, rec.time);
+		recfile.write(reinterpret_cast<const char*>(rec.values.data()), rec.values.size()*sizeof(double));
+		RECORDED = true;
+	}
+	if (RECORDED) {recfile.flush();}
+	file_lock.unlock();
+	
+	// wake up the producers waiting in wait_for_space(), the lock orders this after their check of pending
+	if (popped > 0)
+	{
+		{std::lock_guard<std::mutex> lock(wake_mtx);}
+		cv_space.notify_all();
+	}
+}
+
+std::string Logger::
+format (const Entry &entry) const
+{
+	std::time_t t = std::chrono::system_clock::to_time_t(entry.time);
+	auto ms = std::chrono::duration_cast<std::chrono::milliseconds>(entry.time.time_since_epoch()).count()%1000;
+	std::tm local;
+	localtime_r(&t, &local); // localtime() is not thread-safe
+	char timestr[32];
+	strftime(timestr, sizeof(timestr), "%H:%M:%S", &local);
+	return make_string("[",timestr,".",pad_zeros(ms,3)," T",entry.thread_id,"] ");
+}
+
+int Logger::
+thread_id()
 {
-//	std::ofstream logfile;
-//	logfile.open(filename,ios_base::app);
-//	logfile << val;
-//	logfile.close();
+	static std::atomic<int> counter{0};
+	thread_local int id = counter++;
+	return id;
+}
+
+std::uint64_t Logger::
+next_serial()
+{
+	static std::atomic<std::uint64_t> counter{0};
+	return counter++;
+}
+
+std::stringstream &Logger::
+line()
+{
+	if (std::this_thread::get_id() == owner) {return stream;}
 	
-//	logfile << val;
+	// Every other thread keeps its lines in a list of its own, which needs no lock and is freed when the thread exits.
+	// The serial is never reused, so a new Logger at the address of a destroyed one does not find its lines.
+	struct ThreadLine
+	{
+		std::uint64_t logger;
+		std::weak_ptr<const bool> alive;
+		std::stringstream text;
+	};
+	thread_local std::list<ThreadLine> lines;
 	
-	std::ofstream logfile;
-	logfile.open(filename,std::ios_base::app);
-	string data = remove_termcolor(stream.str());
-	logfile << data;
+	for (auto &l : lines)
+	{
+		if (l.logger == serial_) {return l.text;}
+	}
+	// a new Logger for this thread, drop the lines of the destroyed ones first
+	lines.remove_if([] (const ThreadLine &l) {return l.alive.expired();});
+	lines.emplace_back();
+	lines.back().logger = serial_;
+	lines.back().alive = alive;
+	return lines.back().text;
+}
+
+void Logger::
+open_logfile (std::ios_base::openmode mode)
+{
+	logfile.open(filename, std::ios_base::out | mode);
+	logfile.seekp(0, std::ios_base::end);
+	file_bytes = (logfile.is_open())? static_cast<std::size_t>(logfile.tellp()) : 0;
+	file_opened = std::chrono::steady_clock::now();
+}
+
+std::string Logger::
+segment_name (std::size_t k) const
+{
+	return (COMPRESS_SEGMENTS)? make_string(filename,".",k,".gz") : make_string(filename,".",k);
+}
+
+void Logger::
+rotate()
+{
 	logfile.close();
 	
-	history += data;
+	std::remove(segment_name(rotate_keep).c_str());
+	for (std::size_t k=rotate_keep-1; k>=1; --k)
+	{
+		std::rename(segment_name(k).c_str(), segment_name(k+1).c_str());
+	}
 	
-	stream.str("");
+	#ifdef LOGGER_WITH_ZLIB
+	if (COMPRESS_SEGMENTS)
+	{
+		std::ifstream in(filename, std::ios_base::binary);
+		gzFile out = gzopen(segment_name(1).c_str(), "wb");
+		std::vector<char> buffer(1ul<<16);
+		while (in.read(buffer.data(), buffer.size()) or in.gcount() > 0)
+		{
+			gzwrite(out, buffer.data(), static_cast<unsigned>(in.gcount()));
+		}
+		gzclose(out);
+		in.close();
+		std::remove(filename.c_str());
+	}
+	else
+	{
+		std::rename(filename.c_str(), segment_name(1).c_str());
+	}
+	#else
+	std::rename(filename.c_str(), segment_name(1).c_str());
+	#endif
+	
+	open_logfile(std::ios_base::trunc);
 }
 
 void Logger::
-write()
+set_rotation (std::size_t max_bytes, std::chrono::seconds max_age, std::size_t keep, bool COMPRESS)
+{
+	#ifndef LOGGER_WITH_ZLIB
+	assert(!COMPRESS and "Compression of logfile segments requires LOGGER_WITH_ZLIB!");
+	#endif
+	assert(keep >= 1);
+	std::lock_guard<std::mutex> file_lock(file_mtx);
+	rotate_bytes = max_bytes;
+	rotate_age = max_age;
+	rotate_keep = keep;
+	COMPRESS_SEGMENTS = COMPRESS;
+}
+
+void Logger::
+set_history (std::size_t max_lines, std::size_t max_bytes)
+{
+	std::lock_guard<std::mutex> file_lock(file_mtx);
+	history_max_lines = max_lines;
+	history_max_bytes = max_bytes;
+	trim_history();
+}
+
+void Logger::
+trim_history()
 {
-//	std::ofstream logfile;
-//	logfile.open(filename);
-//	logfile << val;
-//	logfile.close();
+	// the newest line is kept even if it exceeds max_bytes on its own
+	while ((history_max_lines > 0 and history.size() > history_max_lines) or
+	       (history_max_bytes > 0 and history_bytes > history_max_bytes and history.size() > 1))
+	{
+		history_bytes -= history.front().size();
+		history.pop_front();
+	}
+}
+
+std::string Logger::
+get_history()
+{
+	flush();
+	std::lock_guard<std::mutex> file_lock(file_mtx);
+	string res;
+	res.reserve(history_bytes);
+	for (const auto &line : history) {res += line;}
+	return res;
+}
+
+void Logger::
+flush()
+{
+	drain();
+}
+
+void Logger::
+append()
+{
+	std::stringstream &text = line();
+	string res = text.str();
+	text.str("");
+	enqueue(std::move(res));
+}
+
+void Logger::
+enqueue (string &&text)
+{
+	if (text.size() == 0) {return;}
+	Entry entry;
+	entry.text = std::move(text);
+	entry.thread_id = thread_id();
+	entry.time = std::chrono::system_clock::now();
 	
-//	logfile << val;
+	wait_for_space();
+	std::size_t waiting = pending.fetch_add(1, std::memory_order_relaxed)+1;
+	queue.push(std::move(entry));
 	
-	std::ofstream logfile;
-	logfile.open(filename);
-	logfile << stream.str();
-	logfile.close();
-	stream.str("");
+	if (waiting == flush_level)
+	{
+		if (writer.joinable()) {cv_writer.notify_one();}
+		// without a logfile only the history is filled, whoever gets the lock first does it
+		else {drain(false);}
+	}
 }
 
-// std::endl is a function template:
-Logger & Logger::operator << (std::ostream& (*f)(std::ostream&))
+void Logger::
+wait_for_space()
+{
+	// back pressure: the writer has fallen behind by more than capacity entries
+	if (pending.load(std::memory_order_relaxed) < capacity) {return;}
+	if (!writer.joinable()) {drain(); return;}
+	
+	std::unique_lock<std::mutex> lock(wake_mtx);
+	cv_writer.notify_one();
+	cv_space.wait(lock, [this] {return STOP or pending.load(std::memory_order_relaxed) < capacity;});
+}
+
+void Logger::
+record (std::uint32_t schema, std::initializer_list<double> values)
+{
+	const std::vector<std::size_t> *counts = field_counts.load(std::memory_order_acquire);
+	if (counts == nullptr or schema >= counts->size() or values.size() != (*counts)[schema])
+	{
+		throw std::invalid_argument(make_string("Logger::record(): ",values.size()," values do not match the record type ",schema,"."));
+	}
+	
+	Record rec;
+	rec.schema = schema;
+	rec.thread_id = thread_id();
+	rec.time = std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::system_clock::now().time_since_epoch()).count();
+	rec.values = values;
+	
+	wait_for_space();
+	std::size_t waiting = pending.fetch_add(1, std::memory_order_relaxed)+1;
+	records.push(std::move(rec));
+	if (waiting == flush_level and writer.joinable()) {cv_writer.notify_one();}
+}
+
+template<typename T>
+void Logger::
+write_raw (std::ofstream &file, const T &x)
+{
+	file.write(reinterpret_cast<const char*>(&x), sizeof(T));
+}
+
+void Logger::
+write_raw (std::ofstream &file, const string &s)
+{
+	write_raw(file, static_cast<std::uint32_t>(s.size()));
+	file.write(s.data(), s.size());
+}
+
+template<typename T>
+bool Logger::
+read_raw (std::ifstream &file, T &x)
+{
+	return static_cast<bool>(file.read(reinterpret_cast<char*>(&x), sizeof(T)));
+}
+
+bool Logger::
+read_raw (std::ifstream &file, string &s)
+{
+	std::uint32_t length;
+	if (!read_raw(file, length)) {return false;}
+	s.resize(length);
+	return static_cast<bool>(file.read(&s[0], length));
+}
+
+void Logger::
+open_recfile()
+{
+	if (recfile.is_open() or filename.size() == 0) {return;}
+	
+	string recfilename = filename;
+	if (recfilename.size() >= 4 and recfilename.compare(recfilename.size()-4, 4, ".log") == 0) {recfilename.resize(recfilename.size()-4);}
+	recfilename += ".rec";
+	
+	recfile.open(recfilename, std::ios_base::binary | ((APPEND)? std::ios_base::app : std::ios_base::trunc));
+	recfile.seekp(0, std::ios_base::end);
+	if (recfile.tellp() == 0) {write_raw(recfile, RECORD_MAGIC);}
+	for (std::uint32_t schema=0; schema<schemas.size(); ++schema) {write_definition(schema);}
+}
+
+void Logger::
+write_definition (std::uint32_t schema)
+{
+	write_raw(recfile, std::uint32_t(0));
+	write_raw(recfile, schema);
+	write_raw(recfile, schemas[schema].first);
+	write_raw(recfile, static_cast<std::uint32_t>(schemas[schema].second.size()));
+	for (const auto &field : schemas[schema].second) {write_raw(recfile, field);}
+}
+
+std::uint32_t Logger::
+define_record (const string &key, const std::vector<string> &fields)
+{
+	std::lock_guard<std::mutex> file_lock(file_mtx);
+	std::uint32_t schema = schemas.size();
+	schemas.push_back(std::make_pair(key,fields));
+	
+	auto counts = std::make_unique<std::vector<std::size_t> >();
+	for (const auto &s : schemas) {counts->push_back(s.second.size());}
+	field_counts.store(counts.get(), std::memory_order_release);
+	field_count_versions.push_back(std::move(counts));
+	
+	// The definition is written right away, so that it precedes all records of this type in the file.
+	if (recfile.is_open()) {write_definition(schema);}
+	else {open_recfile();}
+	return schema;
+}
+
+std::map<std::string,Logger::RecordTable> Logger::
+read_records (const string &recfilename)
 {
-	f(std::cout);
-//	f(logfile);
-	stream << "\n";
+	std::ifstream file(recfilename, std::ios_base::binary);
+	if (!file.is_open()) {throw std::runtime_error("Could not open the record file "+recfilename+".");}
+	std::uint64_t magic = 0;
+	read_raw(file, magic);
+	if (magic != RECORD_MAGIC) {throw std::runtime_error(recfilename+" is not a record file.");}
+	
+	std::map<string,RecordTable> out;
+	std::map<std::uint32_t,string> keys; // a file appended to by several runs may redefine an id
+	std::uint32_t kind;
+	while (read_raw(file, kind))
+	{
+		std::uint32_t schema;
+		read_raw(file, schema);
+		if (kind == 0)
+		{
+			string key;
+			std::uint32_t Nfields;
+			read_raw(file, key);
+			read_raw(file, Nfields);
+			std::vector<string> fields(Nfields);
+			for (auto &field : fields) {read_raw(file, field);}
+			keys[schema] = key;
+			out[key].fields = fields;
+		}
+		else
+		{
+			if (keys.find(schema) == keys.end()) {throw std::runtime_error(make_string("Record of the undefined type ",schema," in ",recfilename,"."));}
+			RecordTable &table = out[keys[schema]];
+			std::uint32_t thread;
+			std::int64_t time;
+			read_raw(file, thread);
+			read_raw(file, time);
+			std::vector<double> row(table.fields.size());
+			file.read(reinterpret_cast<char*>(row.data()), row.size()*sizeof(double));
+			if (!file) {break;} // truncated by a crash
+			table.thread_id.push_back(thread);
+			table.time.push_back(time);
+			table.rows.push_back(row);
+		}
+	}
+	return out;
+}
+
+void Logger::
+write()
+{
+	stop_writer();
+	open_logfile(std::ios_base::trunc);
+	start_writer();
 	append();
+}
+
+// std::endl is a function template:
+Logger & Logger::operator << (std::ostream& (*)(std::ostream&))
+{
+	std::stringstream &text = line();
+	text << "\n";
+	string res = text.str();
+	text.str("");
+	// The console gets the finished line in one write, so that lines of different threads do not mix,
+	// and without the flush of std::endl.
+	std::cout << res;
+	enqueue(std::move(res));
 	return *this;
 }
 
 template <class T>
 Logger & operator << (Logger &log, T val)
 {
-	log.stream << val;
-	std::cout << val;
+	log.line() << val;
 	return log;
 };
 
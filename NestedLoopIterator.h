@@ -3,12 +3,17 @@
 
 //#include <Eigen/Dense>
 #include <vector>
+#include <array>
 #include <initializer_list>
 #include <algorithm>
 #include <functional>
 #include <assert.h>
 #include <numeric>
 
+#ifdef _OPENMP
+#include <omp.h>
+#endif
+
 class NestedLoopIterator
 {
 public:
@@ -18,7 +23,7 @@ public:
 	NestedLoopIterator (std::size_t dim_input, std::vector<std::size_t> ranges_input);
 	NestedLoopIterator (std::size_t dim_input, std::size_t const_range);
 	
-	void operator++() {++curr_index; make_reverseTensorIndex();};
+	void operator++();
 	
 	std::size_t operator*() {return index();}
 	
@@ -31,19 +36,28 @@ public:
 	std::size_t begin();
 	std::size_t end();
 	
-	inline std::size_t index() {return curr_index;}
-	inline std::size_t index_sum() {return accumulate(tensor_index.begin(), tensor_index.end(), 0);}
+	inline std::size_t index() const {return curr_index;}
+	inline std::size_t index_sum() const {return accumulate(tensor_index.begin(), tensor_index.end(), 0);}
 	inline std::size_t operator() (std::size_t index) const {return tensor_index[index];}
 	inline std::vector<std::size_t> operator() () const {return tensor_index;}
 	
+	/**Calls f(const NestedLoopIterator&) for all indices, distributed in chunks over the OpenMP threads.
+	Each chunk sets its start index once and then increments locally. If \p filters is given, filters[s](i) has to be true for the index i 
+	of the dimension s (an empty std::function accepts everything), otherwise the whole block of indices with this value is skipped.
+	\p chunk=0 chooses the chunk size automatically.*/
+	template<typename Function>
+	void parallel_for (Function f, const std::vector<std::function<bool(std::size_t)> > &filters={}, std::size_t chunk=0) const;
+	
 private:
+	
+	/**Jumps to the next index with a different value of the dimension s, i.e. skips all indices of the faster dimensions.*/
+	void skip (std::size_t s);
 
 	std::size_t dim;
 	std::size_t curr_index;
 	std::size_t total_range;
 	
 	void make_tensorIndex();
-	void make_reverseTensorIndex();
 	
 	std::vector<std::size_t> tensor_index;
 	std::vector<std::size_t> ranges;
@@ -111,26 +125,149 @@ end()
 	return total_range;
 }
 
+// The first index runs fastest, the same order for operator++ and operator=.
 void NestedLoopIterator::
 make_tensorIndex()
 {
 	std::size_t r = curr_index;
-	for (int s=dim-1; s>=0; --s) // must be int!
+	for (std::size_t s=0; s<dim; s++)
 	{
 		tensor_index[s] = r%ranges[s];
 		r /= ranges[s];
 	}
 }
 
+// Odometer: bump the first index and carry, amortized O(1) per step.
 void NestedLoopIterator::
-make_reverseTensorIndex()
+operator++()
 {
-	std::size_t r = curr_index;
-	for (int s=0; s<dim; s++)
+	++curr_index;
+	for (std::size_t s=0; s<dim; s++)
 	{
-		tensor_index[s] = r%ranges[s];
-		r /= ranges[s];
+		if (++tensor_index[s] < ranges[s]) {return;}
+		tensor_index[s] = 0;
+	}
+}
+
+void NestedLoopIterator::
+skip (std::size_t s)
+{
+	std::size_t stride = 1;
+	for (std::size_t t=0; t<s; t++)
+	{
+		curr_index -= tensor_index[t]*stride;
+		stride *= ranges[t];
+		tensor_index[t] = 0;
+	}
+	curr_index += stride;
+	for (std::size_t t=s; t<dim; t++)
+	{
+		if (++tensor_index[t] < ranges[t]) {return;}
+		tensor_index[t] = 0;
+	}
+}
+
+template<typename Function>
+void NestedLoopIterator::
+parallel_for (Function f, const std::vector<std::function<bool(std::size_t)> > &filters, std::size_t chunk) const
+{
+	assert(filters.size() == 0 or filters.size() == dim);
+	
+	// evaluate the filters once for all values
+	std::vector<std::vector<char> > allowed(filters.size());
+	for (std::size_t s=0; s<filters.size(); s++)
+	{
+		allowed[s].resize(ranges[s]);
+		for (std::size_t i=0; i<ranges[s]; i++) {allowed[s][i] = (!filters[s] or filters[s](i));}
+	}
+	
+	if (chunk == 0)
+	{
+		std::size_t threads = 1;
+		#ifdef _OPENMP
+		threads = omp_get_max_threads();
+		#endif
+		chunk = std::max(total_range/(8*threads), static_cast<std::size_t>(1));
+	}
+	std::size_t Nchunks = (total_range+chunk-1)/chunk;
+	
+	#ifdef _OPENMP
+	#pragma omp parallel for schedule(dynamic)
+	#endif
+	for (std::size_t c=0; c<Nchunks; c++)
+	{
+		std::size_t stop = std::min(total_range, (c+1)*chunk);
+		NestedLoopIterator it(*this);
+		it = c*chunk;
+		
+		while (it.curr_index < stop)
+		{
+			// skip at the slowest rejected dimension to prune the largest block
+			std::size_t s = allowed.size();
+			while (s > 0 and allowed[s-1][it.tensor_index[s-1]]) {--s;}
+			if (s == 0) {f(static_cast<const NestedLoopIterator&>(it)); ++it;}
+			else {it.skip(s-1);}
+		}
 	}
 }
 
+/**NestedLoopIterator with the dimension known at compile time. The indices are kept in a std::array, so that the odometer is unrolled
+and can stay in registers, and everything is constexpr. operator() returns a reference to the indices for structured bindings:
+	for (StaticNestedLoopIterator<3> it({L,L,L}); it!=it.end(); ++it) {auto [i,j,k] = it(); ...}*/
+template<std::size_t Dim>
+class StaticNestedLoopIterator
+{
+public:
+	
+	constexpr StaticNestedLoopIterator (const std::array<std::size_t,Dim> &ranges_input)
+	:ranges(ranges_input)
+	{
+		for (std::size_t s=0; s<Dim; s++) {total_range *= ranges[s];}
+	}
+	
+	constexpr void operator++()
+	{
+		++curr_index;
+		for (std::size_t s=0; s<Dim; s++)
+		{
+			if (++tensor_index[s] < ranges[s]) {return;}
+			tensor_index[s] = 0;
+		}
+	}
+	
+	constexpr StaticNestedLoopIterator& operator= (const std::size_t &cmp)
+	{
+		curr_index = cmp;
+		std::size_t r = curr_index;
+		for (std::size_t s=0; s<Dim; s++)
+		{
+			tensor_index[s] = r%ranges[s];
+			r /= ranges[s];
+		}
+		return *this;
+	}
+	
+	constexpr std::size_t operator*() const {return curr_index;}
+	
+	constexpr bool operator<  (const std::size_t &cmp) const {return curr_index< cmp;}
+	constexpr bool operator<= (const std::size_t &cmp) const {return curr_index<=cmp;}
+	constexpr bool operator!= (const std::size_t &cmp) const {return curr_index!=cmp;}
+	constexpr bool operator== (const std::size_t &cmp) const {return curr_index==cmp;}
+	
+	constexpr std::size_t begin() const {return 0;}
+	constexpr std::size_t end() const {return total_range;}
+	
+	constexpr std::size_t index() const {return curr_index;}
+	constexpr std::size_t index_sum() const {std::size_t out=0; for (const auto &i:tensor_index) {out+=i;} return out;}
+	constexpr std::size_t operator() (std::size_t s) const {return tensor_index[s];}
+	constexpr const std::array<std::size_t,Dim> &operator() () const {return tensor_index;}
+	
+private:
+	
+	std::array<std::size_t,Dim> ranges{};
+	std::array<std::size_t,Dim> tensor_index{};
+	std::size_t total_range = 1;
+	std::size_t curr_index = 0;
+};
+
 #endif
@@ -0,0 +1,168 @@
+#ifndef PERFCOUNTERS
+#define PERFCOUNTERS
+
+#include <iostream>
+#include <sstream>
+#include <string>
+#include <vector>
+#include <array>
+#include <cstdint>
+#include <cstring>
+#include <cmath>
+
+#ifdef __linux__
+#include <unistd.h>
+#include <sys/ioctl.h>
+#include <sys/syscall.h>
+#include <linux/perf_event.h>
+#endif
+
+#include "Stopwatch.h"
+
+enum PERF_COUNTER {CYCLES=0, INSTRUCTIONS=1, CACHE_REFERENCES=2, CACHE_MISSES=3, BRANCHES=4, BRANCH_MISSES=5};
+
+/**Hardware counters of the calling thread around a timed region, read with the perf_event_open syscall (Linux only).
+Counters which cannot be opened (perf_event_paranoid, virtual machines without a PMU) are skipped and reported as unavailable,
+the wall time is always measured. The counters are opened as three groups of two (cycles and instructions, cache references and misses,
+branches and branch misses), so that each ratio is measured over the same instructions, while a PMU with few counters can still schedule every group.*/
+template<typename ClockClass=std::chrono::high_resolution_clock>
+class PerfCounters
+{
+public:
+
+	PerfCounters();
+	~PerfCounters();
+
+	PerfCounters (const PerfCounters&) = delete;
+	PerfCounters &operator= (const PerfCounters&) = delete;
+
+	void start();
+	void stop();
+
+	bool available (PERF_COUNTER c) const {return fd[c] != -1;}
+
+	/**Counter value of the last start()/stop() interval, scaled up if the kernel had to multiplex the counters.
+	NaN if the counter is not available.*/
+	double value (PERF_COUNTER c) const {return values[c];}
+
+	double time() const {return seconds;}
+	double ipc() const {return values[INSTRUCTIONS]/values[CYCLES];}
+	double cache_miss_rate() const {return values[CACHE_MISSES]/values[CACHE_REFERENCES];}
+	double branch_miss_rate() const {return values[BRANCH_MISSES]/values[BRANCHES];}
+
+	/**Same format as Stopwatch::info, followed by IPC, miss rates and GFLOP/s if \p flops is given.
+	Stops the counters if they are running and restarts them if \p RESTART is set.*/
+	template<typename ThemeType> std::string info (ThemeType theme, double flops=0., bool RESTART=true);
+
+private:
+
+	std::array<int,6> fd;
+	std::array<double,6> values;
+	Stopwatch<ClockClass> watch;
+	double seconds = 0.;
+	bool RUNNING = false;
+	// first counter of each group that could be opened, -1 if none
+	std::array<int,3> leader;
+};
+
+template<typename ClockClass>
+PerfCounters<ClockClass>::
+PerfCounters()
+{
+	fd.fill(-1);
+	values.fill(std::nan(""));
+	leader.fill(-1);
+
+	#ifdef __linux__
+	const std::array<std::uint64_t,6> config = {PERF_COUNT_HW_CPU_CYCLES, PERF_COUNT_HW_INSTRUCTIONS,
+	                                            PERF_COUNT_HW_CACHE_REFERENCES, PERF_COUNT_HW_CACHE_MISSES,
+	                                            PERF_COUNT_HW_BRANCH_INSTRUCTIONS, PERF_COUNT_HW_BRANCH_MISSES};
+	for (int c=0; c<6; ++c)
+	{
+		int &group = leader[c/2];
+		perf_event_attr attr;
+		std::memset(&attr, 0, sizeof(attr));
+		attr.size = sizeof(attr);
+		attr.type = PERF_TYPE_HARDWARE;
+		attr.config = config[c];
+		attr.disabled = (group == -1)? 1:0;
+		attr.exclude_kernel = 1;
+		attr.exclude_hv = 1;
+		attr.read_format = PERF_FORMAT_TOTAL_TIME_ENABLED | PERF_FORMAT_TOTAL_TIME_RUNNING;
+
+		// the first counter of a group which opens leads it
+		fd[c] = syscall(__NR_perf_event_open, &attr, 0, -1, group, 0);
+		if (fd[c] != -1 and group == -1) {group = fd[c];}
+	}
+	#endif
+}
+
+template<typename ClockClass>
+PerfCounters<ClockClass>::
+~PerfCounters()
+{
+	#ifdef __linux__
+	for (int c=0; c<6; ++c)
+	{
+		if (fd[c] != -1) {close(fd[c]);}
+	}
+	#endif
+}
+
+template<typename ClockClass>
+void PerfCounters<ClockClass>::
+start()
+{
+	#ifdef __linux__
+	for (int group : leader)
+	{
+		if (group == -1) {continue;}
+		ioctl(group, PERF_EVENT_IOC_RESET, PERF_IOC_FLAG_GROUP);
+		ioctl(group, PERF_EVENT_IOC_ENABLE, PERF_IOC_FLAG_GROUP);
+	}
+	#endif
+	RUNNING = true;
+	watch.start();
+}
+
+template<typename ClockClass>
+void PerfCounters<ClockClass>::
+stop()
+{
+	seconds = watch.time(SECONDS);
+	#ifdef __linux__
+	for (int group : leader)
+	{
+		if (group != -1) {ioctl(group, PERF_EVENT_IOC_DISABLE, PERF_IOC_FLAG_GROUP);}
+	}
+	for (int c=0; c<6; ++c)
+	{
+		if (fd[c] == -1) {continue;}
+		std::uint64_t data[3]; // value, time enabled, time running (0 if the group was never scheduled)
+		if (read(fd[c], data, sizeof(data)) != sizeof(data) or data[2] == 0) {values[c] = std::nan(""); continue;}
+		values[c] = static_cast<double>(data[0])*data[1]/data[2];
+	}
+	#endif
+	RUNNING = false;
+}
+
+template<typename ClockClass>
+template<typename ThemeType>
+std::string PerfCounters<ClockClass>::
+info (ThemeType theme, double flops, bool RESTART)
+{
+	if (RUNNING) {stop();}
+
+	std::stringstream ss;
+	ss << theme << ": " << format_time(seconds);
+	if (available(CYCLES) and available(INSTRUCTIONS)) {ss << ", IPC=" << ipc();}
+	if (available(CACHE_REFERENCES) and available(CACHE_MISSES)) {ss << ", cache miss rate=" << 100.*cache_miss_rate() << "%";}
+	if (available(BRANCHES) and available(BRANCH_MISSES)) {ss << ", branch miss rate=" << 100.*branch_miss_rate() << "%";}
+	if (leader[0] == -1 and leader[1] == -1 and leader[2] == -1) {ss << ", hardware counters unavailable";}
+	if (flops > 0.) {ss << ", " << 1e-9*flops/seconds << " #GFLOP/s";}
+
+	if (RESTART) {start();}
+	return ss.str();
+}
+
+#endif
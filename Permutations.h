@@ -9,10 +9,21 @@
 #include <algorithm>
 #include <numeric>
 #include <cassert>
+#include <cstdint>
+#include <cstdlib>
+#include <sstream>
+#include <stdexcept>
+#include <unordered_map>
 
-#include "macros.h"
+#ifdef _OPENMP
+#include <omp.h>
+#endif
+
+#ifdef __AVX2__
+#include <immintrin.h>
+#endif
 
-#include <boost/algorithm/string.hpp>
+#include "macros.h"
 
 #ifdef TOOLS_HAS_BOOST_HASH_COMBINE
 #include <boost/functional/hash.hpp>
@@ -47,20 +58,24 @@ struct Permutation
                 initialize();
         }
 
+        // Reads the text format: one line "source<TAB>target" per element, blank lines and lines starting with # are skipped.
+        // Throws std::invalid_argument for a line without two numbers.
         Permutation(const std::string filename) {                
                 std::ifstream stream(filename, std::ios::in);
                 std::string line;
                 if(stream.is_open()) {
                         while(std::getline(stream, line)) {
-                                std::vector<std::string> results;
-                                
-                                boost::split(results, line, [](char c) { return c == '\t'; });
-                                if(results[0].find("#") != std::string::npos) { continue; } // skip lines with a hashtag
-                                int source = stoi(results[0]);
-                                int target = stoi(results[1]);
+                                if (line.find_first_not_of(" \t\r") == std::string::npos or line.find("#") < line.find("\t")) { continue; } // skip blank lines and lines with a hashtag
+                                char* end_source;
+                                char* end_target;
+                                long source = std::strtol(line.c_str(), &end_source, 10);
+                                long target = std::strtol(end_source, &end_target, 10);
+                                if (end_source == line.c_str() or end_target == end_source) {
+                                        throw std::invalid_argument("Invalid permutation data in file "+filename+": \""+line+"\".");
+                                }
                                 assert(source >=0 and "Invalid permutation data in file.");
                                 assert(target >=0 and "Invalid permutation data in file.");
-                                if (source >= pi.size()) {pi.resize(source+1);}
+                                if (static_cast<std::size_t>(source) >= pi.size()) {pi.resize(source+1);}
                                 pi[source] = target;
                         }
                         stream.close();
@@ -68,16 +83,74 @@ struct Permutation
                 N = pi.size();
                 
                 //consistency check
-                std::set<std::size_t> bijectivePermutation;
-                for (std::size_t i=0; i<N; i++)
-                {
-                    assert(pi[i] < N and "Invalid permutation data in file.");
-                    auto it = bijectivePermutation.find(pi[i]);
-                    if (it == bijectivePermutation.end()) {bijectivePermutation.insert(pi[i]);}
-                    else {assert(false and "Invalid permutation data in file.");}
-                }
+                assert(IS_BIJECTIVE(pi) and "Invalid permutation data in file.");
                 initialize();
         };
+        
+        // O(N) check with a bitmap that every number 0...N-1 appears exactly once.
+        static bool IS_BIJECTIVE(const std::vector<std::size_t>& pi) {
+                std::vector<bool> seen(pi.size(), false);
+                for (const auto& x:pi) {
+                        if (x >= pi.size() or seen[x]) {return false;}
+                        seen[x] = true;
+                }
+                return true;
+        }
+        
+        // Binary format: the magic number, the number of permutations and then for each permutation N followed by pi, all as uint64.
+        static constexpr std::uint64_t BINARY_MAGIC = 0x4d524550534c4f54ull; // "TOLSPERM" in little endian
+        
+        // Throws std::runtime_error if the file cannot be opened or written.
+        static void save_binary(const std::vector<Permutation>& batch, const std::string filename) {
+                std::vector<std::uint64_t> data = {BINARY_MAGIC, batch.size()};
+                for (const auto& p:batch) {
+                        data.push_back(p.N);
+                        data.insert(data.end(), p.pi.begin(), p.pi.end());
+                }
+                std::ofstream stream(filename, std::ios::out|std::ios::binary|std::ios::trunc);
+                if (!stream.is_open()) {throw std::runtime_error("Could not open the permutation file "+filename+".");}
+                stream.write(reinterpret_cast<const char*>(data.data()), data.size()*sizeof(std::uint64_t));
+                stream.close();
+                if (!stream) {throw std::runtime_error("Could not write the permutation file "+filename+".");}
+        }
+        
+        // Reads the whole file at once and checks every permutation with IS_BIJECTIVE. Throws std::runtime_error for invalid data.
+        static std::vector<Permutation> load_binary(const std::string filename) {
+                std::ifstream stream(filename, std::ios::in|std::ios::binary|std::ios::ate);
+                if (!stream.is_open()) {throw std::runtime_error("Could not open the permutation file "+filename+".");}
+                std::size_t bytes = stream.tellg();
+                stream.seekg(0);
+                std::vector<std::uint64_t> data(bytes/sizeof(std::uint64_t));
+                stream.read(reinterpret_cast<char*>(data.data()), data.size()*sizeof(std::uint64_t));
+                auto invalid = [&filename] (const std::string& reason) {return std::runtime_error("Invalid permutation data in file "+filename+": "+reason+".");};
+                if (bytes%sizeof(std::uint64_t) != 0 or data.size() < 2 or data[0] != BINARY_MAGIC) {throw invalid("no permutation file");}
+                // every permutation takes at least one word for its size
+                if (data[1] > data.size()-2) {throw invalid("the number of permutations exceeds the file size");}
+                
+                std::vector<Permutation> out(data[1]);
+                std::size_t pos = 2;
+                for (auto& p:out) {
+                        if (pos >= data.size()) {throw invalid("the file is truncated");}
+                        std::uint64_t N_p = data[pos++];
+                        if (N_p > data.size()-pos) {throw invalid("the size of a permutation exceeds the file size");}
+                        p.pi.assign(data.begin()+pos, data.begin()+pos+N_p);
+                        pos += N_p;
+                        if (!IS_BIJECTIVE(p.pi)) {throw invalid("not a permutation");}
+                        p.initialize();
+                }
+                return out;
+        }
+        
+        void save_binary(const std::string filename) const {save_binary({*this}, filename);}
+        
+        // Throws std::runtime_error unless the file contains exactly one permutation.
+        static Permutation load_single_binary(const std::string filename) {
+                auto out = load_binary(filename);
+                if (out.size() != 1) {
+                        throw std::runtime_error("The permutation file "+filename+" contains "+std::to_string(out.size())+" permutations instead of one.");
+                }
+                return out[0];
+        }
     
         void initialize() {
                 N=pi.size();
@@ -86,28 +159,18 @@ struct Permutation
                         pi_inv[pi[i]] = i;
                 }
                 
+                // every element is visited exactly once, cycles start at their smallest element
+                cycles.clear();
                 std::vector<bool> visited(N,false);
-                while (!std::all_of(visited.cbegin(), visited.cend(), [] (bool b) {return b;})) {
-                        auto start_it = std::find(visited.cbegin(), visited.cend(), false);
-                        std::size_t start = std::distance(visited.cbegin(),start_it);
-                        
-                        visited[pi_inv[start]]=true;
-                        
+                for (std::size_t start=0; start<N; start++) {
+                        if (visited[start]) {continue;}
                         Cycle cycle;
-                        cycle.push_back(start);
-                        auto tmp=start;
-                        for (std::size_t i=0; i<N; i++) {
-                                auto next_power = pi[tmp];
-                                if (next_power == start) {continue;}
-                                else {
-                                        cycle.push_back(next_power);
-                                        visited[pi_inv[next_power]]=true;
-                                        tmp = next_power;
-                                }
-                        }                                
+                        for (std::size_t tmp=start; !visited[tmp]; tmp=pi[tmp]) {
+                                visited[tmp]=true;
+                                cycle.push_back(tmp);
+                        }
                         cycles.push_back(cycle);
-                }       
-        
+                }
         }
     
 #ifdef TOOLS_HAS_BOOST_HASH_COMBINE
@@ -117,8 +180,20 @@ struct Permutation
                 boost::hash_combine(seed, p.pi);
                 return seed;
         }
+#else
+        friend std::size_t hash_value(const Permutation& p)
+        {
+                std::size_t seed = 0;
+                for (const auto& x:p.pi) {seed ^= std::hash<std::size_t>()(x) + 0x9e3779b9 + (seed<<6) + (seed>>2);}
+                return seed;
+        }
 #endif
         
+        struct Hash
+        {
+                std::size_t operator() (const Permutation& p) const {return hash_value(p);}
+        };
+        
         bool operator== (const Permutation& other) const
         {                
                 return pi == other.pi;
@@ -130,6 +205,7 @@ struct Permutation
                 return Permutation(id);
         }
 
+        // Materializes all N! permutations, use PermutationRange to enumerate them lazily.
         static std::vector<Permutation> all(std::size_t N) {
                 std::vector<std::size_t> data(N); std::iota(data.begin(), data.end(), 0ul);
                 std::vector<Permutation> out;
@@ -140,6 +216,39 @@ struct Permutation
                 return out;
         }
         
+        // Number of permutations of N elements (N <= 20 to fit into std::size_t).
+        static std::size_t factorial(std::size_t N) {
+                assert(N <= 20 and "N! does not fit into std::size_t.");
+                std::size_t out=1;
+                for (std::size_t k=2; k<=N; k++) {out *= k;}
+                return out;
+        }
+        
+        // The permutation with the given rank in lexicographic order (the order of all()), from its Lehmer code.
+        static std::vector<std::size_t> unrank(std::size_t N, std::size_t rank) {
+                assert(rank < factorial(N));
+                std::vector<std::size_t> remaining(N); std::iota(remaining.begin(), remaining.end(), 0ul);
+                std::vector<std::size_t> out(N);
+                for (std::size_t k=0; k<N; k++) {
+                        std::size_t f = factorial(N-1-k);
+                        std::size_t digit = rank/f;
+                        rank %= f;
+                        out[k] = remaining[digit];
+                        remaining.erase(remaining.begin()+digit);
+                }
+                return out;
+        }
+        
+        // Inverse of unrank.
+        static std::size_t rank(const std::vector<std::size_t>& pi) {
+                std::size_t out=0;
+                for (std::size_t k=0; k<pi.size(); k++) {
+                        std::size_t digit = std::count_if(pi.begin()+k+1, pi.end(), [&pi,k] (std::size_t x) {return x < pi[k];});
+                        out += digit * factorial(pi.size()-1-k);
+                }
+                return out;
+        }
+        
         std::string print() const {
                 std::stringstream ss;
                 for (const auto& c:cycles) {
@@ -184,33 +293,27 @@ struct Permutation
         };
     
         std::vector<std::size_t> decompose() const {
-            std::vector<bool> visited(N,false);
-            std::vector<std::size_t> a(N);
-            std::iota(a.begin(), a.end(), 0ul);
-            
+            // Bubbles pi[0], pi[1], ... successively to the front of the identity with adjacent swaps (j <-> j+1).
+            // The elements not yet placed keep their increasing order, so the number of swaps for pi[i] is the number of
+            // remaining elements smaller than pi[i]. They are counted by walking a linked list of the remaining elements,
+            // which costs exactly one step per emitted swap: O(N + swaps) in total.
             std::vector<std::size_t> out;
-            if (a == pi) {return out;} //early return if it is the identity permutation
+            if (N == 0) {return out;}
+            
+            std::vector<std::size_t> next(N), prev(N);
+            for (std::size_t k=0; k<N; k++) {next[k] = k+1; prev[k] = k-1;} // N and -1 mark the ends
+            std::size_t head = 0;
             
             for (std::size_t i=0; i<N; i++) {
-                    auto index = std::distance(a.begin(), std::find(a.begin(), a.end(), pi[i]));
-                    // std::cout << "i=" << i << ", pi[i]=" << pi[i] << ", index=" << index << ", a="; for (const auto& o:a) {std::cout << o << " ";} std::cout << std::endl;
-                    if (index == 0) {continue;}
-                    if (i == 0) {
-                            for (std::size_t j=index-1; j<index; --j) {
-                                    // std::cout << "j=" << j << std::endl;
-                                    std::swap(a[j],a[j+1]);
-                                    out.push_back(j);
-                            }
-                    }
-                    else {
-                            for (std::size_t j=index-1; j>=i; --j) {
-                                    // std::cout << "j=" << j << std::endl;
-                                    std::swap(a[j],a[j+1]);
-                                    out.push_back(j);
-                            }
-                    }
+                    std::size_t smaller = 0;
+                    for (std::size_t k=head; k!=pi[i]; k=next[k]) {smaller++;}
+                    for (std::size_t j=i+smaller-1; j+1>i; --j) {out.push_back(j);}
+                    
+                    // remove pi[i] from the remaining elements
+                    if (pi[i] == head) {head = next[pi[i]];}
+                    else {next[prev[pi[i]]] = next[pi[i]];}
+                    if (next[pi[i]] < N) {prev[next[pi[i]]] = prev[pi[i]];}
             }
-            assert(a == pi and "Error when determining the swaps of a permutation.");
             return out;
         }
 
@@ -221,20 +324,103 @@ struct Permutation
                 return out%2;
         }
 
+        // c_new[i] = c_old[pi[i]], in place by rotating the elements along the cycles (no scratch memory besides one element).
         template<typename Container>
         void apply(Container& c) const {
                 if (c.size() == 1) {return;}
-                Container tmp(c);
-                for (std::size_t i=0; i<c.size(); i++) {
-                        tmp[i] = c[pi[i]];    
+                assert(static_cast<std::size_t>(c.size()) == N);
+                for (const auto& cycle : cycles) {
+                        if (cycle.size() == 1) {continue;}
+                        typename Container::value_type tmp = std::move(c[cycle[0]]); // not auto, which is a proxy reference for std::vector<bool>
+                        for (std::size_t m=0; m<cycle.size()-1; m++) {c[cycle[m]] = std::move(c[cycle[m+1]]);}
+                        c[cycle.back()] = std::move(tmp);
+                }
+        }
+        
+        // out[i] = in[pi[i]] into a caller-provided buffer of size N (in and out must not overlap).
+        template<typename Scalar>
+        void apply(const Scalar* in, Scalar* out) const {
+                for (std::size_t i=0; i<N; i++) {out[i] = in[pi[i]];}
+        }
+        
+#ifdef __AVX2__
+        void apply(const double* in, double* out) const {
+                static_assert(sizeof(std::size_t) == sizeof(long long), "The gather uses 64-bit indices.");
+                std::size_t i=0;
+                for (; i+4<=N; i+=4) {
+                        __m256i idx = _mm256_loadu_si256(reinterpret_cast<const __m256i*>(pi.data()+i));
+                        _mm256_storeu_pd(out+i, _mm256_i64gather_pd(in, idx, 8));
+                }
+                for (; i<N; i++) {out[i] = in[pi[i]];}
+        }
+#endif
+        
+        // M_new.row(i) = M_old.row(pi[i]) for any matrix type with operator()(i,j), rows() and cols() (e.g. Eigen).
+        // The columns are independent and distributed over the OpenMP threads.
+        template<typename MatrixType>
+        void apply_rows(MatrixType& M) const {
+                assert(static_cast<std::size_t>(M.rows()) == N);
+                #ifdef _OPENMP
+                #pragma omp parallel for
+                #endif
+                for (long j=0; j<static_cast<long>(M.cols()); j++) {
+                        for (const auto& cycle : cycles) {
+                                if (cycle.size() == 1) {continue;}
+                                auto tmp = M(cycle[0],j);
+                                for (std::size_t m=0; m<cycle.size()-1; m++) {M(cycle[m],j) = M(cycle[m+1],j);}
+                                M(cycle.back(),j) = tmp;
+                        }
+                }
+        }
+        
+        // M_new.col(j) = M_old.col(pi[j]), rotating along the cycles with swaps. Blocks of rows are distributed over the OpenMP threads.
+        template<typename MatrixType>
+        void apply_cols(MatrixType& M, long rows_per_block=256) const {
+                assert(static_cast<std::size_t>(M.cols()) == N);
+                long blocks = (static_cast<long>(M.rows())+rows_per_block-1)/rows_per_block;
+                #ifdef _OPENMP
+                #pragma omp parallel for
+                #endif
+                for (long b=0; b<blocks; b++) {
+                        long r_end = std::min(static_cast<long>(M.rows()), (b+1)*rows_per_block);
+                        for (const auto& cycle : cycles) {
+                                for (std::size_t m=0; m+1<cycle.size(); m++) {
+                                        for (long r=b*rows_per_block; r<r_end; r++) {std::swap(M(r,cycle[m]), M(r,cycle[m+1]));}
+                                }
+                        }
                 }
-                c=tmp;
         }
 
         Permutation inverse() const {
                 Permutation out(pi_inv);
                 return out;
         }
+        
+        // (p*q).pi[i] = p.pi[q.pi[i]], so that applying p*q is the same as applying p and then q.
+        Permutation operator* (const Permutation& other) const {
+                assert(N == other.N);
+                std::vector<std::size_t> out(N);
+                for (std::size_t i=0; i<N; i++) {out[i] = pi[other.pi[i]];}
+                return Permutation(out);
+        }
+        
+        // pi^k (also for negative k) in O(N): each element moves k steps along its cycle.
+        Permutation power(long k) const {
+                std::vector<std::size_t> out(N);
+                for (const auto& c : cycles) {
+                        long L = c.size();
+                        long shift = ((k%L)+L)%L;
+                        for (long m=0; m<L; m++) {out[c[m]] = c[(m+shift)%L];}
+                }
+                return Permutation(out);
+        }
+        
+        // Smallest k>0 with pi^k = id (the lcm of the cycle lengths).
+        std::size_t order() const {
+                std::size_t out=1;
+                for (const auto& c : cycles) {out = std::lcm(out, c.size());}
+                return out;
+        }
 
         template<typename IndexType>
         std::vector<IndexType> pi_as_index() const {
@@ -243,10 +429,153 @@ struct Permutation
                 return out;
         }
 
-        std::size_t N;
+        std::size_t N=0;
         std::vector<std::size_t> pi;
         std::vector<std::size_t> pi_inv;
         std::vector<Cycle> cycles;
 };
 
+// Lazy enumeration of the permutations of N elements with ranks in [first,last) in lexicographic order.
+// Only the current pi is stored, the full Permutation (with its cycles) is built on demand.
+// The rank space can be split into independent subranges which are enumerated in parallel.
+struct PermutationRange
+{
+        struct iterator
+        {
+                iterator(std::size_t N, std::size_t rank_in): rank_(rank_in) {
+                        if (rank_ < Permutation::factorial(N)) {pi = Permutation::unrank(N, rank_);}
+                }
+                // past-the-end iterator, it only compares the rank
+                explicit iterator(std::size_t rank_in): rank_(rank_in) {}
+                const std::vector<std::size_t>& operator*() const {return pi;}
+                const std::vector<std::size_t>* operator->() const {return &pi;}
+                iterator& operator++() {std::next_permutation(pi.begin(), pi.end()); ++rank_; return *this;}
+                bool operator== (const iterator& other) const {return rank_ == other.rank_;}
+                bool operator!= (const iterator& other) const {return rank_ != other.rank_;}
+                
+                std::size_t rank() const {return rank_;}
+                Permutation permutation() const {return Permutation(pi);}
+                
+        private:
+                std::size_t rank_;
+                std::vector<std::size_t> pi;
+        };
+        
+        PermutationRange(std::size_t N_in): N(N_in), first(0), last(Permutation::factorial(N_in)) {};
+        PermutationRange(std::size_t N_in, std::size_t first_in, std::size_t last_in): N(N_in), first(first_in), last(last_in) {
+                assert(first <= last and last <= Permutation::factorial(N));
+        };
+        
+        iterator begin() const {return iterator(N, first);}
+        
+        iterator end() const {return iterator(last);}
+        
+        std::size_t size() const {return last-first;}
+        
+        // Splits into (at most) parts subranges of almost equal size.
+        std::vector<PermutationRange> split(std::size_t parts) const {
+                std::vector<PermutationRange> out;
+                if (parts == 0) {parts = 1;}
+                std::size_t chunk = size()/parts;
+                std::size_t rest = size()%parts;
+                std::size_t start = first;
+                for (std::size_t k=0; k<parts and start<last; k++) {
+                        std::size_t stop = start + chunk + ((k<rest)? 1:0);
+                        out.push_back(PermutationRange(N, start, stop));
+                        start = stop;
+                }
+                return out;
+        }
+        
+        // Calls f(pi, rank) for all permutations of the range, distributed over the OpenMP threads in chunks.
+        template<typename Function>
+        void parallel_for_each(Function f, std::size_t chunks_per_thread=4) const {
+                std::size_t threads = 1;
+                #ifdef _OPENMP
+                threads = omp_get_max_threads();
+                #endif
+                auto subranges = split(threads*chunks_per_thread);
+                #ifdef _OPENMP
+                #pragma omp parallel for schedule(dynamic)
+                #endif
+                for (std::size_t k=0; k<subranges.size(); k++) {
+                        for (auto it=subranges[k].begin(); it!=subranges[k].end(); ++it) {f(*it, it.rank());}
+                }
+        }
+        
+        std::size_t N;
+        std::size_t first;
+        std::size_t last;
+};
+
+// Finite group generated by a set of permutations (e.g. lattice translations and reflections).
+// All elements are generated once, the multiplication table stores the index of a*b for all pairs,
+// so that group operations in symmetry-projected calculations are lookups.
+class PermutationGroup
+{
+public:
+        PermutationGroup() {};
+        
+        PermutationGroup(const std::vector<Permutation>& generators_in, bool BUILD_TABLE=true)
+        :generators(generators_in) {
+                assert(generators.size() > 0);
+                add(Permutation::Identity(generators[0].N));
+                
+                // closure under right multiplication with the generators
+                for (std::size_t k=0; k<elements.size(); k++) {
+                        for (const auto& g : generators) {
+                                Permutation p = elements[k]*g;
+                                if (lookup.find(p) == lookup.end()) {add(p);}
+                        }
+                }
+                
+                inverses.resize(size());
+                for (std::size_t a=0; a<size(); a++) {inverses[a] = index(elements[a].inverse());}
+                
+                if (BUILD_TABLE) {make_table();}
+        }
+        
+        std::size_t size() const {return elements.size();}
+        
+        const Permutation& operator[] (std::size_t a) const {return elements[a];}
+        
+        // index of the element p, size() if p is not in the group
+        std::size_t index(const Permutation& p) const {
+                auto it = lookup.find(p);
+                return (it == lookup.end())? size() : it->second;
+        }
+        
+        // index of elements[a]*elements[b]
+        std::size_t multiply(std::size_t a, std::size_t b) const {
+                if (table.size() > 0) {return table[a*size()+b];}
+                return index(elements[a]*elements[b]);
+        }
+        
+        std::size_t inverse(std::size_t a) const {return inverses[a];}
+        
+        void make_table() {
+                std::size_t G = size();
+                table.resize(G*G);
+                #ifdef _OPENMP
+                #pragma omp parallel for
+                #endif
+                for (long a=0; a<static_cast<long>(G); a++) {
+                        for (std::size_t b=0; b<G; b++) {table[a*G+b] = index(elements[a]*elements[b]);}
+                }
+        }
+        
+        std::vector<Permutation> generators;
+        
+private:
+        void add(const Permutation& p) {
+                lookup[p] = elements.size();
+                elements.push_back(p);
+        }
+        
+        std::vector<Permutation> elements;
+        std::unordered_map<Permutation,std::size_t,Permutation::Hash> lookup;
+        std::vector<std::size_t> inverses;
+        std::vector<std::size_t> table;
+};
+
 #endif
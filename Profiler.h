@@ -0,0 +1,314 @@
+#ifndef PROFILER
+#define PROFILER
+
+#include <iostream>
+#include <fstream>
+#include <sstream>
+#include <iomanip>
+#include <chrono>
+#include <cstring>
+#include <cstdint>
+#include <limits>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <vector>
+#include <algorithm>
+#include <atomic>
+
+#include "Stopwatch.h"
+#include "StringStuff.h"
+
+/**Hierarchical profiler: ScopedTimer objects nest into a call tree per thread, which are merged by the path of scope names at report time.
+Scope names have to be string literals (or otherwise outlive the profiler), since only the pointer is stored.
+report() and save_trace() must not be called while timers are running in other threads.
+The default clock is TscClock, which is cheaper to read than steady_clock.*/
+template<typename ClockClass=TscClock>
+class Profiler
+{
+public:
+
+	/**Node of the call tree. Times in nanoseconds.*/
+	struct Node
+	{
+		Node (const char *name_input=nullptr, int parent_input=-1) : name(name_input), parent(parent_input) {};
+		
+		const char *name;
+		int parent;
+		std::vector<int> children;
+		std::uint64_t calls = 0;
+		std::int64_t total = 0;
+		std::int64_t children_total = 0;
+		std::int64_t min = std::numeric_limits<std::int64_t>::max();
+		std::int64_t max = 0;
+
+		std::int64_t self() const {return total-children_total;}
+	};
+
+	/**One closed scope for the trace, start in nanoseconds since the profiler was created.*/
+	struct Event
+	{
+		const char *name;
+		std::int64_t start;
+		std::int64_t duration;
+	};
+
+	struct ThreadData
+	{
+		std::vector<Node> nodes = {Node("total",-1)};
+		int current = 0;
+		int thread_id = 0;
+		std::vector<Event> events;
+
+		inline int enter (const char *name);
+		inline void leave (int index, std::int64_t dt);
+	};
+
+	static Profiler &instance() {static Profiler p; return p;}
+
+	/**Tree of the calling thread, created and registered on first use.*/
+	static inline ThreadData &local();
+
+	/**Also record every scope as an event for save_trace().*/
+	void set_trace (bool TRACE_IN) {TRACE.store(TRACE_IN, std::memory_order_relaxed);}
+	bool trace() const {return TRACE.load(std::memory_order_relaxed);}
+
+	/**Trees of all threads, merged by the path of names.*/
+	std::vector<Node> merged() const;
+
+	/**Text table with calls, total, self, min and max time of every scope, indented by depth.*/
+	std::string report() const;
+
+	/**Writes the recorded events in the Chrome trace-event format (chrome://tracing, Perfetto).*/
+	void save_trace (const std::string &filename) const;
+
+	/**Resets all trees and events.*/
+	void clear();
+
+	std::int64_t since_start (typename ClockClass::time_point t) const
+	{
+		return std::chrono::duration_cast<std::chrono::nanoseconds>(t-t_start).count();
+	}
+
+private:
+
+	Profiler() : t_start(ClockClass::now()) {};
+
+	void merge_into (std::vector<Node> &out, int target, const std::vector<Node> &tree, int source) const;
+	void print (std::ostream &os, const std::vector<Node> &tree, int index, int depth, std::int64_t reference) const;
+
+	typename ClockClass::time_point t_start;
+	std::atomic<bool> TRACE{false};
+
+	// owns the data of all threads, so that it survives the end of a thread
+	mutable std::mutex registry_mtx;
+	std::vector<std::unique_ptr<ThreadData> > registry;
+};
+
+/**Times the enclosing scope and adds it to the call tree of the calling thread.*/
+template<typename ClockClass=TscClock>
+class ScopedTimer
+{
+public:
+
+	inline ScopedTimer (const char *name)
+	:data(Profiler<ClockClass>::local())
+	{
+		index = data.enter(name);
+		t_start = ClockClass::now();
+	}
+
+	inline ~ScopedTimer()
+	{
+		auto t_end = ClockClass::now();
+		std::int64_t dt = std::chrono::duration_cast<std::chrono::nanoseconds>(t_end-t_start).count();
+		data.leave(index, dt);
+		if (Profiler<ClockClass>::instance().trace())
+		{
+			data.events.push_back({data.nodes[index].name, Profiler<ClockClass>::instance().since_start(t_start), dt});
+		}
+	}
+
+	ScopedTimer (const ScopedTimer&) = delete;
+	ScopedTimer &operator= (const ScopedTimer&) = delete;
+
+private:
+
+	typename Profiler<ClockClass>::ThreadData &data;
+	int index;
+	typename ClockClass::time_point t_start;
+};
+
+#define TOOLS_PROFILE_CONCAT_(a,b) a##b
+#define TOOLS_PROFILE_CONCAT(a,b) TOOLS_PROFILE_CONCAT_(a,b)
+#define PROFILE_SCOPE(name) ScopedTimer<> TOOLS_PROFILE_CONCAT(profile_scope_,__LINE__)(name)
+
+template<typename ClockClass>
+inline int Profiler<ClockClass>::ThreadData::
+enter (const char *name)
+{
+	// few children per node, a linear search is faster than a map
+	for (int child : nodes[current].children)
+	{
+		if (nodes[child].name == name or std::strcmp(nodes[child].name, name) == 0)
+		{
+			current = child;
+			return child;
+		}
+	}
+	nodes.push_back(Node(name,current));
+	int index = nodes.size()-1;
+	nodes[current].children.push_back(index);
+	current = index;
+	return index;
+}
+
+template<typename ClockClass>
+inline void Profiler<ClockClass>::ThreadData::
+leave (int index, std::int64_t dt)
+{
+	Node &node = nodes[index];
+	++node.calls;
+	node.total += dt;
+	node.min = std::min(node.min, dt);
+	node.max = std::max(node.max, dt);
+	current = node.parent;
+	nodes[current].children_total += dt;
+}
+
+template<typename ClockClass>
+inline typename Profiler<ClockClass>::ThreadData &Profiler<ClockClass>::
+local()
+{
+	thread_local ThreadData *data = nullptr;
+	if (data == nullptr)
+	{
+		Profiler &p = instance();
+		std::lock_guard<std::mutex> lock(p.registry_mtx);
+		p.registry.emplace_back(new ThreadData());
+		data = p.registry.back().get();
+		data->thread_id = p.registry.size()-1;
+	}
+	return *data;
+}
+
+template<typename ClockClass>
+void Profiler<ClockClass>::
+merge_into (std::vector<Node> &out, int target, const std::vector<Node> &tree, int source) const
+{
+	for (int child : tree[source].children)
+	{
+		const Node &node = tree[child];
+		int match = -1;
+		for (int c : out[target].children)
+		{
+			if (std::strcmp(out[c].name, node.name) == 0) {match = c; break;}
+		}
+		if (match == -1)
+		{
+			out.push_back(Node(node.name,target));
+			match = out.size()-1;
+			out[target].children.push_back(match);
+		}
+		out[match].calls += node.calls;
+		out[match].total += node.total;
+		out[match].children_total += node.children_total;
+		out[match].min = std::min(out[match].min, node.min);
+		out[match].max = std::max(out[match].max, node.max);
+		merge_into(out, match, tree, child);
+	}
+}
+
+template<typename ClockClass>
+std::vector<typename Profiler<ClockClass>::Node> Profiler<ClockClass>::
+merged() const
+{
+	std::vector<Node> out = {Node("total",-1)};
+	std::lock_guard<std::mutex> lock(registry_mtx);
+	for (const auto &data : registry)
+	{
+		merge_into(out, 0, data->nodes, 0);
+	}
+	for (int child : out[0].children) {out[0].total += out[child].total;}
+	out[0].children_total = out[0].total;
+	return out;
+}
+
+template<typename ClockClass>
+void Profiler<ClockClass>::
+print (std::ostream &os, const std::vector<Node> &tree, int index, int depth, std::int64_t reference) const
+{
+	const Node &node = tree[index];
+	if (index != 0)
+	{
+		auto ms = [] (std::int64_t ns) {return 1e-6*ns;};
+		os << std::left << std::setw(40) << (std::string(2*(depth-1),' ')+node.name) << std::right
+		   << std::setw(10) << node.calls
+		   << std::setw(14) << ms(node.total)
+		   << std::setw(14) << ms(node.self())
+		   << std::setw(12) << ms(node.min)
+		   << std::setw(12) << ms(node.max)
+		   << std::setw(8) << ((reference>0)? 100.*node.total/reference : 0.) << "\n";
+	}
+
+	std::vector<int> children = node.children;
+	std::sort(children.begin(), children.end(), [&tree] (int a, int b) {return tree[a].total > tree[b].total;});
+	for (int child : children) {print(os, tree, child, depth+1, reference);}
+}
+
+template<typename ClockClass>
+std::string Profiler<ClockClass>::
+report() const
+{
+	std::vector<Node> tree = merged();
+	std::stringstream ss;
+	ss << std::fixed << std::setprecision(3);
+	ss << std::left << std::setw(40) << "scope" << std::right
+	   << std::setw(10) << "calls"
+	   << std::setw(14) << "total[ms]"
+	   << std::setw(14) << "self[ms]"
+	   << std::setw(12) << "min[ms]"
+	   << std::setw(12) << "max[ms]"
+	   << std::setw(8) << "%" << "\n";
+	print(ss, tree, 0, 0, tree[0].total);
+	return ss.str();
+}
+
+template<typename ClockClass>
+void Profiler<ClockClass>::
+save_trace (const std::string &filename) const
+{
+	std::ofstream file(filename);
+	file << std::fixed << std::setprecision(3);
+	file << "{\"traceEvents\":[";
+	bool FIRST = true;
+	std::lock_guard<std::mutex> lock(registry_mtx);
+	for (const auto &data : registry)
+	{
+		for (const auto &event : data->events)
+		{
+			if (!FIRST) {file << ",";}
+			FIRST = false;
+			// timestamps in microseconds with nanosecond resolution, complete events ("X") carry their duration
+			file << "\n{\"name\":\"" << json_escape(event.name) << "\",\"ph\":\"X\",\"pid\":0,\"tid\":" << data->thread_id
+			     << ",\"ts\":" << 1e-3*event.start << ",\"dur\":" << 1e-3*event.duration << "}";
+		}
+	}
+	file << "\n],\"displayTimeUnit\":\"ms\"}\n";
+}
+
+template<typename ClockClass>
+void Profiler<ClockClass>::
+clear()
+{
+	std::lock_guard<std::mutex> lock(registry_mtx);
+	for (auto &data : registry)
+	{
+		data->nodes.resize(1);
+		data->nodes[0].children.clear();
+		data->current = 0;
+		data->events.clear();
+	}
+}
+
+#endif
@@ -6,11 +6,194 @@
 #include <chrono>
 #include <sstream>
 #include <functional>
+#include <cstdint>
+#include <vector>
+#include <thread>
+#include <type_traits>
+#include <algorithm>
+#include <cmath>
+#include <limits>
+#include <cassert>
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <x86intrin.h>
+#define TOOLS_HAS_RDTSC 1
+#endif
 
 #include "macros.h"
 
 enum TIME_UNIT {MILLISECONDS, SECONDS, MINUTES, HOURS, DAYS, NATURAL};
 
+/**Formats a time in seconds as in Stopwatch::info: in #s below one minute, then in #min, #h and #d.*/
+inline std::string format_time (double seconds)
+{
+	std::stringstream ss;
+	if      (seconds < 60.)    {ss << seconds << " #s";}
+	else if (seconds < 3600.)  {ss << seconds/60. << " #min";}
+	else if (seconds < 86400.) {ss << seconds/3600. << " #h";}
+	else                       {ss << seconds/86400. << " #d";}
+	return ss.str();
+}
+
+/**Makes the compiler assume that \p value is read, so that the computation of it is not optimized away.*/
+template<typename T>
+inline void DoNotOptimize (const T &value)
+{
+	#if defined(__GNUC__) || defined(__clang__)
+	asm volatile("" : : "r,m"(value) : "memory");
+	#else
+	static volatile const T *sink;
+	sink = &value;
+	#endif
+}
+
+/**Makes the compiler additionally assume that \p value may be changed here, so that computations with it are not hoisted out of loops.*/
+template<typename T>
+inline void DoNotOptimize (T &value)
+{
+	#if defined(__GNUC__) || defined(__clang__)
+	asm volatile("" : "+r,m"(value) : : "memory");
+	#else
+	static volatile T *sink;
+	sink = &value;
+	#endif
+}
+
+/**Makes the compiler assume that all memory is read and written here, so that stores before it are not removed.*/
+inline void ClobberMemory()
+{
+	#if defined(__GNUC__) || defined(__clang__)
+	asm volatile("" : : : "memory");
+	#endif
+}
+
+/**Parameters of Stopwatch::benchmark.*/
+struct BenchmarkOptions
+{
+	int warmup = 3;
+	int min_repetitions = 10;
+	int max_repetitions = 1000;
+	double max_seconds = 5.; // stop repeating after this total time, even if not stable
+	double tolerance = 0.02; // stable if MAD/median is below
+	double min_sample_seconds = 1e-3; // fast functions are called several times per sample
+};
+
+/**Statistics of the time per call in seconds.*/
+struct BenchmarkResult
+{
+	double median, mad, mean, min, max, p05, p25, p75, p95;
+	int repetitions; // number of samples
+	long calls_per_sample;
+	bool STABLE;
+	
+	template<typename ThemeType> std::string info (ThemeType theme) const
+	{
+		std::stringstream ss;
+		ss << theme << ": median=" << median << " #s, MAD=" << mad << " #s, p05=" << p05 << ", p95=" << p95
+		   << ", min=" << min << ", max=" << max << " (" << repetitions << "x" << calls_per_sample << " calls"
+		   << ((STABLE)? "" : ", not stable") << ")";
+		return ss.str();
+	}
+};
+
+/**Clock based on the time stamp counter, which is much cheaper to read than the system clocks.
+Can be used as ClockClass for Stopwatch and ScopedTimer. The tick rate is calibrated once against steady_clock at the first use.
+Assumes an invariant TSC (constant rate, synchronized across cores), as on all x86 CPUs of the last decade.
+Without rdtsc, the steady_clock is used.*/
+struct TscClock
+{
+	typedef std::chrono::nanoseconds duration;
+	typedef duration::rep rep;
+	typedef duration::period period;
+	typedef std::chrono::time_point<TscClock> time_point;
+	static constexpr bool is_steady = true;
+	
+	/**Raw counter value. With \p SERIALIZE, rdtscp is used, which waits for all preceding instructions (use it to stop a measurement).*/
+	static inline std::uint64_t ticks (bool SERIALIZE=false)
+	{
+		#ifdef TOOLS_HAS_RDTSC
+		if (SERIALIZE) {unsigned aux; return __rdtscp(&aux);}
+		return __rdtsc();
+		#else
+		return std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::steady_clock::now().time_since_epoch()).count();
+		#endif
+	}
+	
+	static inline time_point now()
+	{
+		const Calibration &c = calibration();
+		return time_point(duration(static_cast<rep>(c.ns_per_tick*static_cast<double>(ticks()-c.tick0))));
+	}
+	
+	static inline double seconds (std::uint64_t dticks) {return 1e-9*calibration().ns_per_tick*dticks;}
+	
+	/**Ticks per second.*/
+	static double frequency() {return 1e9/calibration().ns_per_tick;}
+	
+private:
+	
+	struct Calibration
+	{
+		Calibration()
+		{
+			#ifdef TOOLS_HAS_RDTSC
+			auto t0 = std::chrono::steady_clock::now();
+			std::uint64_t c0 = ticks(true);
+			std::this_thread::sleep_for(std::chrono::milliseconds(20));
+			auto t1 = std::chrono::steady_clock::now();
+			std::uint64_t c1 = ticks(true);
+			ns_per_tick = std::chrono::duration<double,std::nano>(t1-t0).count()/(c1-c0);
+			tick0 = c0;
+			#endif
+		}
+		
+		double ns_per_tick = 1.;
+		std::uint64_t tick0 = 0;
+	};
+	
+	static inline const Calibration &calibration() {static const Calibration c; return c;}
+};
+
+/**Accumulate-only timing for tight loops: start() and stop() only read the TSC and add raw ticks to a preallocated slot.
+The conversion to seconds and any formatting happens at report time.*/
+class TickAccumulator
+{
+public:
+	
+	TickAccumulator (std::size_t Nslots)
+	:total(Nslots,0), count(Nslots,0), begin(Nslots,0)
+	{
+		TscClock::frequency(); // calibrate outside of the measurement
+	};
+	
+	inline void start (std::size_t slot) {begin[slot] = TscClock::ticks();}
+	inline void stop (std::size_t slot) {total[slot] += TscClock::ticks(true)-begin[slot]; ++count[slot];}
+	
+	/**Adds ticks measured elsewhere, e.g. by the thread-local copy of an accumulator.*/
+	void add (std::size_t slot, std::uint64_t ticks, std::uint64_t calls=1) {total[slot] += ticks; count[slot] += calls;}
+	
+	std::size_t size() const {return total.size();}
+	std::uint64_t ticks (std::size_t slot) const {return total[slot];}
+	std::uint64_t calls (std::size_t slot) const {return count[slot];}
+	double seconds (std::size_t slot) const {return TscClock::seconds(total[slot]);}
+	
+	template<typename ThemeType> std::string info (std::size_t slot, ThemeType theme) const
+	{
+		std::stringstream ss;
+		ss << theme << ": " << seconds(slot) << " #s, " << count[slot] << " calls, "
+		   << ((count[slot]>0)? 1e9*seconds(slot)/count[slot] : 0.) << " #ns/call";
+		return ss.str();
+	}
+	
+	void clear() {std::fill(total.begin(),total.end(),0); std::fill(count.begin(),count.end(),0);}
+	
+private:
+	
+	std::vector<std::uint64_t> total;
+	std::vector<std::uint64_t> count;
+	std::vector<std::uint64_t> begin;
+};
+
 template<typename ClockClass=std::chrono::high_resolution_clock>
 class Stopwatch
 {
@@ -28,9 +211,14 @@ public:
 	template<typename ThemeType> void check (ThemeType theme);
 	void check();
 	
-	#ifdef HELPERS_HAS_CONSTEXPR
+	#ifdef TOOLS_HAS_CONSTEXPR
+	template<typename ThemeType, class F, class... ArgTypes>
+	std::invoke_result_t<F&&,ArgTypes&&...> runTime(ThemeType theme, F&& f, ArgTypes&&... args);
+	
+	/**Calls \p f a few times to warm up, then takes samples until MAD/median is below the tolerance, the maximal number of samples
+	or the maximal time is reached. Results of \p f are passed through DoNotOptimize. Prints the result like runTime.*/
 	template<typename ThemeType, class F, class... ArgTypes>
-	std::result_of_t<F&&(ArgTypes&&...)> runTime(ThemeType theme, F&& f, ArgTypes&&... args);
+	BenchmarkResult benchmark (ThemeType theme, const BenchmarkOptions &opt, F&& f, ArgTypes&&... args);
 	#endif
 	
 private:
@@ -142,29 +330,10 @@ info (ThemeType theme, bool RESTART)
 {
 	t_end = ClockClass::now();
 	
-	std::chrono::duration<double, std::ratio<1,1> > dtTest = t_end-t_start;
+	std::chrono::duration<double, std::ratio<1,1> > dt = t_end-t_start;
 	
 	std::stringstream ss;
-	if (dtTest.count()<60.)
-	{
-		std::chrono::duration<double, std::ratio<1,1> > dt = t_end-t_start;
-		ss << theme << ": " << dt.count() << " #s";
-	}
-	else if (dtTest.count()>=60. && dtTest.count()<3600.)
-	{
-		std::chrono::duration<double, std::ratio<60,1> > dt = t_end-t_start;
-		ss << theme << ": " << dt.count() << " #min";
-	}
-	else if (dtTest.count()>=3600. && dtTest.count()<86400.)
-	{
-		std::chrono::duration<double, std::ratio<3600,1> > dt = t_end-t_start;
-		ss << theme << ": " << dt.count() << " #h";
-	}
-	else
-	{
-		std::chrono::duration<double, std::ratio<86400,1> > dt = t_end-t_start;
-		ss << theme << ": " << dt.count() << " #d";
-	}
+	ss << theme << ": " << format_time(dt.count());
 	
 	if (SAVING_TO_FILE == true)
 	{
@@ -178,27 +347,128 @@ info (ThemeType theme, bool RESTART)
 	return ss.str();
 }
 
-#ifdef HELPERS_HAS_CONSTEXPR
+#ifdef TOOLS_HAS_CONSTEXPR
 template<typename ClockClass>
 template <typename ThemeType,  class F, class... ArgTypes>
-std::result_of_t<F&&(ArgTypes&&...)> Stopwatch<ClockClass>::
+std::invoke_result_t<F&&,ArgTypes&&...> Stopwatch<ClockClass>::
 runTime(ThemeType theme, F&& f, ArgTypes&&... args)
 {
 	start();
-	if constexpr ( std::is_void<std::result_of_t<F&&(ArgTypes&&...)> >::value )
-				 {
-					 return std::invoke(std::forward<F>(f),std::forward<ArgTypes>(args)...);
-					 // if (SAVING_TO_FILE == false) { std::cout << info(theme) << std::endl; }
-					 // else { info(theme); }
-				 }
+	if constexpr (std::is_void<std::invoke_result_t<F&&,ArgTypes&&...> >::value)
+	{
+		std::invoke(std::forward<F>(f),std::forward<ArgTypes>(args)...);
+		if (SAVING_TO_FILE == false) { std::cout << info(theme) << std::endl; }
+		else { info(theme); }
+	}
 	else
 	{
-		std::result_of_t<F&&(ArgTypes&&...)> result = std::invoke(std::forward<F>(f),std::forward<ArgTypes>(args)...);
+		std::invoke_result_t<F&&,ArgTypes&&...> result = std::invoke(std::forward<F>(f),std::forward<ArgTypes>(args)...);
 		if (SAVING_TO_FILE == false) { std::cout << info(theme) << std::endl; }
 		else { info(theme); }
 		return result;
 	}
 }
+
+template<typename ClockClass>
+template <typename ThemeType,  class F, class... ArgTypes>
+BenchmarkResult Stopwatch<ClockClass>::
+benchmark (ThemeType theme, const BenchmarkOptions &opt, F&& f, ArgTypes&&... args)
+{
+	assert(opt.min_repetitions >= 1 and opt.min_repetitions <= opt.max_repetitions and "Invalid number of repetitions.");
+	
+	// f is called repeatedly, so the arguments are not forwarded
+	auto call = [&] ()
+	{
+		(DoNotOptimize(args), ...);
+		if constexpr (std::is_void<std::invoke_result_t<F&,ArgTypes&...> >::value) {std::invoke(f,args...); ClobberMemory();}
+		else {DoNotOptimize(std::invoke(f,args...));}
+	};
+	auto seconds_since = [] (std::chrono::time_point<ClockClass> t0)
+	{
+		return std::chrono::duration<double>(ClockClass::now()-t0).count();
+	};
+	
+	for (int i=0; i<opt.warmup; ++i) {call();}
+	
+	// calls per sample, doubled until one sample takes long enough to be resolved by the clock
+	long calls = 1;
+	while (true)
+	{
+		auto t0 = ClockClass::now();
+		for (long i=0; i<calls; ++i) {call();}
+		if (seconds_since(t0) >= opt.min_sample_seconds or calls >= (1l<<30)) {break;}
+		calls *= 2;
+	}
+	
+	auto median_of = [] (std::vector<double> v)
+	{
+		std::sort(v.begin(), v.end());
+		std::size_t n = v.size();
+		return (n%2==1)? v[n/2] : 0.5*(v[n/2-1]+v[n/2]);
+	};
+	
+	std::vector<double> samples;
+	double median = 0., mad = 0.;
+	bool STABLE = false;
+	auto t_begin = ClockClass::now();
+	while (static_cast<int>(samples.size()) < opt.max_repetitions)
+	{
+		auto t0 = ClockClass::now();
+		for (long i=0; i<calls; ++i) {call();}
+		samples.push_back(seconds_since(t0)/calls);
+		
+		if (static_cast<int>(samples.size()) < opt.min_repetitions) {continue;}
+		median = median_of(samples);
+		std::vector<double> deviations(samples.size());
+		for (std::size_t i=0; i<samples.size(); ++i) {deviations[i] = std::abs(samples[i]-median);}
+		mad = median_of(deviations);
+		STABLE = (mad <= opt.tolerance*median);
+		if (STABLE or seconds_since(t_begin) > opt.max_seconds) {break;}
+	}
+	if (median == 0.)
+	{
+		median = median_of(samples);
+		std::vector<double> deviations(samples.size());
+		for (std::size_t i=0; i<samples.size(); ++i) {deviations[i] = std::abs(samples[i]-median);}
+		mad = median_of(deviations);
+	}
+	
+	std::sort(samples.begin(), samples.end());
+	auto percentile = [&samples] (double p)
+	{
+		double x = p*(samples.size()-1);
+		std::size_t i = static_cast<std::size_t>(x);
+		return (i+1 < samples.size())? samples[i]+(x-i)*(samples[i+1]-samples[i]) : samples[i];
+	};
+	
+	BenchmarkResult res;
+	res.median = median;
+	res.mad = mad;
+	res.mean = 0.;
+	for (double x : samples) {res.mean += x/samples.size();}
+	res.min = samples.front();
+	res.max = samples.back();
+	res.p05 = percentile(0.05);
+	res.p25 = percentile(0.25);
+	res.p75 = percentile(0.75);
+	res.p95 = percentile(0.95);
+	res.repetitions = samples.size();
+	res.calls_per_sample = calls;
+	res.STABLE = STABLE;
+	
+	if (SAVING_TO_FILE == true)
+	{
+		std::fstream outfile;
+		outfile.open(filename, std::fstream::app|std::fstream::out);
+		outfile << res.info(theme) << std::endl;
+		outfile.close();
+	}
+	else
+	{
+		std::cout << res.info(theme) << std::endl;
+	}
+	return res;
+}
 #endif
 
 template<typename ClockClass>
@@ -6,6 +6,7 @@
 #include <vector>
 #include <clocale>
 #include <cstdlib>
+#include <cstdio>
 #include <iomanip>
 
 void draw_progressBar (int len, double percent)
@@ -140,4 +141,27 @@ std::size_t strlen_mb (const std::string& s)
     }
     return result;
 }
+
+/**Escapes quotes, backslashes and control characters for the use inside a JSON string.*/
+std::string json_escape (const std::string &s)
+{
+	std::string out;
+	out.reserve(s.size());
+	for (char c : s)
+	{
+		if      (c == '"')  {out += "\\\"";}
+		else if (c == '\\') {out += "\\\\";}
+		else if (c == '\n') {out += "\\n";}
+		else if (c == '\t') {out += "\\t";}
+		else if (static_cast<unsigned char>(c) < 0x20)
+		{
+			char code[8];
+			std::snprintf(code, sizeof(code), "\\u%04x", static_cast<unsigned>(c));
+			out += code;
+		}
+		else {out += c;}
+	}
+	return out;
+}
+
 #endif
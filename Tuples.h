@@ -2,6 +2,16 @@
 #define TUPLES_Q
 
 #include <iostream>
+#include <array>
+#include <stdexcept>
+#include <algorithm>
+#include <cassert>
+#include <cstdint>
+#include <bitset>
+#include <limits>
+#include <type_traits>
+#include <utility>
+#include <vector>
 
 //#include <boost/math/special_functions/binomial.hpp>
 
@@ -12,6 +22,7 @@ template<size_t R, size_t N, typename Index=int>
 class Tuples
 {
 	using size_t = std::size_t;
+	typedef std::array<std::array<size_t,R+1>,N+1> BinomialTable;
 public:
 	/**Returns true if the \param j 'th tuple contains the number \param k and otherwise false.
 	 \param j : j is the number of the tuple to check
@@ -25,15 +36,182 @@ public:
 	/**Returns the number \param j of the tuple \param tuple.
 	   \param tuple*/
 	static size_t getNumber( const std::array<Index,N> &tuple );
+	
+	/**Tuple as a bitmask, bit k is set if k is contained (uint64_t for R<=64, std::bitset otherwise).*/
+	typedef typename std::conditional<(R<=64), std::uint64_t, std::bitset<R> >::type Mask;
+	
+	/**Returns the \param j 'th tuple as a bitmask, throws std::out_of_range for j>=size().*/
+	static Mask getMask(size_t j);
+	
+	/**Returns the number of the tuple given as a bitmask, using only its set bits (O(N) for R<=64).*/
+	static size_t getNumberFromMask( const Mask &mask );
+	
+	/**Returns true if the tuple given as a bitmask contains the number \param k (O(1)), false for k>=R.*/
+	static bool isPresentInMask( const Mask &mask, size_t k );
+	
+	/**Converts many numbers into bitmasks (and back), one by one with the loop distributed over the OpenMP threads.*/
+	static std::vector<Mask> getMasks( const std::vector<size_t> &numbers );
+	static std::vector<size_t> getNumbers( const std::vector<Mask> &masks );
+	
+	/**Binomial coefficient n over k for n<=R and k<=N from the precomputed Pascal triangle (saturated at the maximum of size_t).*/
+	static constexpr size_t binomial ( size_t n, size_t k ) {return (k<=N and n<=R)? table[k][n] : 0;}
+	
+	/**Number of tuples.*/
+	static constexpr size_t size() {return table[N][R];}
+	
+	/**Iterates over all tuples in lexicographic order (the numbering of getTuple) in amortized O(1) per step.
+	   Use like NestedLoopIterator: for (LexIterator it; it!=it.end(); ++it) {...}*/
+	class LexIterator
+	{
+	public:
+		LexIterator() {for (size_t k=0; k<N; k++) {t[k] = static_cast<Index>(k);}}
+		
+		void operator++()
+		{
+			++curr_index;
+			if (curr_index == size()) {return;}
+			size_t k = N-1;
+			while (static_cast<size_t>(t[k]) == R-N+k) {--k;}
+			++t[k];
+			for (size_t i=k+1; i<N; i++) {t[i] = t[i-1]+1;}
+			first_changed_ = k;
+		}
+		
+		const std::array<Index,N> &operator*() const {return t;}
+		inline Index operator() (size_t k) const {return t[k];}
+		
+		bool operator!= (const size_t &cmp) const {return curr_index!=cmp;}
+		bool operator<  (const size_t &cmp) const {return curr_index< cmp;}
+		
+		size_t begin() const {return 0;}
+		size_t end() const {return size();}
+		
+		/**number of the current tuple*/
+		inline size_t index() const {return curr_index;}
+		
+		/**the last step changed the positions first_changed()...N-1 of the tuple*/
+		inline size_t first_changed() const {return first_changed_;}
+		
+	private:
+		std::array<Index,N> t;
+		size_t curr_index = 0;
+		size_t first_changed_ = 0;
+	};
+	
+	/**Iterates over all tuples in the revolving-door Gray code (Knuth, TAOCP 7.2.1.3, Algorithm R):
+	   two successive tuples differ by removing one number (out) and adding another (in), which only changes the positions changed() of the sorted tuple.
+	   The order is not the numbering of getTuple, use getNumber if the number is needed.*/
+	class GrayIterator
+	{
+	public:
+		GrayIterator() {for (size_t k=0; k<N; k++) {t[k] = static_cast<Index>(k);}}
+		
+		void operator++()
+		{
+			++curr_index;
+			if (curr_index == size()) {return;}
+			
+			// c(j) is c_j in the 1-based notation of Knuth with the sentinels c_{N+1}=R and c_{N+2}=R+1
+			auto c = [this] (size_t j) -> long {return (j<=N)? static_cast<long>(t[j-1]) : static_cast<long>(R+j-N-1);};
+			
+			// R3: easy case
+			if (N%2 == 1 and c(1)+1 < c(2)) {set_step(0, 0, t[0], t[0]+1); ++t[0]; return;}
+			if (N%2 == 0 and c(1) > 0)       {set_step(0, 0, t[0], t[0]-1); --t[0]; return;}
+			
+			size_t j = 2;
+			bool TRY_DECREASE = (N%2 == 1);
+			if (TRY_DECREASE and j > N) {return;}
+			while (true)
+			{
+				// R4: try to decrease c_j
+				if (TRY_DECREASE)
+				{
+					if (c(j) >= static_cast<long>(j))
+					{
+						set_step(j-2, j-1, t[j-1], static_cast<Index>(j-2));
+						t[j-1] = t[j-2];
+						t[j-2] = static_cast<Index>(j-2);
+						return;
+					}
+					++j;
+				}
+				
+				// R5: try to increase c_j
+				if (c(j)+1 < c(j+1))
+				{
+					set_step(j-2, j-1, t[j-2], t[j-1]+1);
+					t[j-2] = t[j-1];
+					++t[j-1];
+					return;
+				}
+				++j;
+				if (j > N) {return;}
+				TRY_DECREASE = true;
+			}
+		}
+		
+		const std::array<Index,N> &operator*() const {return t;}
+		inline Index operator() (size_t k) const {return t[k];}
+		
+		bool operator!= (const size_t &cmp) const {return curr_index!=cmp;}
+		bool operator<  (const size_t &cmp) const {return curr_index< cmp;}
+		
+		size_t begin() const {return 0;}
+		size_t end() const {return size();}
+		
+		/**number of steps taken*/
+		inline size_t index() const {return curr_index;}
+		
+		/**number removed and number added in the last step*/
+		inline Index out() const {return out_;}
+		inline Index in() const {return in_;}
+		
+		/**first and last position of the sorted tuple changed in the last step*/
+		inline std::pair<size_t,size_t> changed() const {return changed_;}
+		
+	private:
+		void set_step (size_t first, size_t last, Index out_input, Index in_input)
+		{
+			changed_ = std::make_pair(first,last); out_ = out_input; in_ = in_input;
+		}
+		
+		std::array<Index,N> t;
+		size_t curr_index = 0;
+		std::pair<size_t,size_t> changed_ = std::make_pair(0,0);
+		Index out_ = 0;
+		Index in_ = 0;
+	};
 
 private:
 	static void sort( std::array<Index,N> &tuple );
-	static size_t getFirstNumber ( size_t R_, size_t N_, size_t j );
-	static size_t firstN ( size_t R_, size_t N_, size_t j );
-	static size_t binomial ( size_t , size_t k );
-	static size_t factorial ( size_t n );
+	
+	/**Pascal triangle, stored as table[k][n] so that the column of a fixed k is increasing in n.
+	Entries which do not fit into size_t saturate at its maximum, none of them is used for the numbering if C(R,N) fits.*/
+	static constexpr BinomialTable make_table();
+	static constexpr BinomialTable table = make_table();
+	
+	static_assert(table[N][R] < std::numeric_limits<size_t>::max(), "The number of tuples C(R,N) does not fit into size_t.");
 };
 
+template<size_t R, size_t N, typename Index>
+constexpr typename Tuples<R,N,Index>::BinomialTable Tuples<R,N,Index>::
+make_table()
+{
+	BinomialTable out{};
+	for (size_t n=0; n<=R; n++)
+	{
+		out[0][n] = 1;
+		for (size_t k=1; k<=N and k<=n; k++)
+		{
+			out[k][n] = (out[k-1][n-1] > std::numeric_limits<size_t>::max()-out[k][n-1])? std::numeric_limits<size_t>::max() : out[k-1][n-1] + out[k][n-1];
+		}
+	}
+	return out;
+}
+
+// The tuples are numbered in lexicographic order. With c_k = R-1-t_k this is the reverse of the colexicographic order
+// of the combinatorial number system, so that j = C(R,N)-1-sum_k C(c_k,N-k).
+
 template<size_t R, size_t N, typename Index>
 size_t Tuples<R,N,Index>::
 getNumber( const std::array<Index,N> &tuple )
@@ -41,21 +219,11 @@ getNumber( const std::array<Index,N> &tuple )
 	auto t=tuple;
 	sort(t);
 	size_t out=0;
-	size_t R_=R;
 	for (size_t k=0; k<N; k++)
 	{
-		if( k==0 )
-		{
-			(t[k] > 0) ? out += firstN(R_,N-k,t[k]-1) : out += 0;
-			R_ -= t[k]+1;
-		}
-		else
-		{
-			(t[k]-t[k-1]-1 > 0) ? out += firstN(R_,N-k,(t[k]-t[k-1]-2)) : out += 0;
-			R_ -= t[k] - t[k-1];
-		}
+		out += table[N-k][R-1-t[k]];
 	}
-	return out;
+	return size()-1-out;
 }
 
 template<size_t R, size_t N, typename Index>
@@ -63,7 +231,6 @@ bool Tuples<R,N,Index>::
 isPresent(size_t j, size_t k)
 {
 	auto t=getTuple(j);
-	sort(t);
 	auto it = std::find(t.begin(),t.end(),k);
 	if (it != t.end()) { return true; }
 	else { return false; }
@@ -73,67 +240,107 @@ template<size_t R, size_t N, typename Index>
 std::array<Index,N> Tuples<R,N,Index>::
 getTuple(size_t j)
 {
+	assert(j < size() and "invalid number.");
 	std::array<Index,N> out;
-	size_t R_=R;
-	std::vector<size_t>	j_; j_.push_back(j);
-	size_t offset=0;
+	size_t x = size()-1-j;
+	size_t c_max = R;
 	for (size_t k=0; k<N; k++)
 	{
-		out[k] = static_cast<Index>(getFirstNumber(R_,N-k,j_[k]) + offset);
-		if (getFirstNumber(R_,N-k,j_[k]) > 0) { j_.push_back( j_[k] - firstN(R_,N-k,getFirstNumber(R_,N-k,j_[k])-1)); }
-		else { j_.push_back(j_[k]); }
-		offset += getFirstNumber(R_,N-k,j_[k])+1;
-		R_ -= getFirstNumber(R_,N-k,j_[k])+1;
+		// largest c < c_max with C(c,N-k) <= x
+		const auto &column = table[N-k];
+		size_t c = std::distance(column.begin(), std::upper_bound(column.begin(), column.begin()+c_max, x)) - 1;
+		x -= column[c];
+		out[k] = static_cast<Index>(R-1-c);
+		c_max = c;
 	}
 	return out;
 }
 
 template<size_t R, size_t N, typename Index>
-void Tuples<R,N,Index>::
-sort( std::array<Index,N> &tuple )
+typename Tuples<R,N,Index>::Mask Tuples<R,N,Index>::
+getMask(size_t j)
 {
-	std::sort(tuple.begin(),tuple.end());
+	if (j >= size()) {throw std::out_of_range("Tuples::getMask: invalid number.");}
+	Mask out{};
+	for (const auto &k : getTuple(j))
+	{
+		if constexpr (R<=64) {out |= std::uint64_t(1) << k;}
+		else {out.set(k);}
+	}
+	return out;
 }
 
 template<size_t R, size_t N, typename Index>
 size_t Tuples<R,N,Index>::
-getFirstNumber( size_t R_, size_t N_, size_t j )
+getNumberFromMask( const Mask &mask )
 {
-	for (size_t k=0; k<=R_-N_; k++)
+	size_t out=0;
+	size_t k=0;
+	if constexpr (R<=64)
 	{
-		size_t lower;
-		( k == 0 ) ? lower = 0 : lower = firstN(R_,N_,k-1);
-		auto upper = firstN(R_,N_,k);
-		if ( j >= lower and j < upper ) { return k; }
+		assert(__builtin_popcountll(mask) == N and "invalid bitmask.");
+		// visit the set bits in increasing order and clear the lowest one in each step
+		for (std::uint64_t m=mask; m!=0; m&=m-1, ++k)
+		{
+			out += table[N-k][R-1-__builtin_ctzll(m)];
+		}
 	}
-	assert(false and "error");
+	else
+	{
+		assert(mask.count() == N and "invalid bitmask.");
+		for (size_t t=0; t<R; t++)
+		{
+			if (mask.test(t)) {out += table[N-k][R-1-t]; ++k;}
+		}
+	}
+	return size()-1-out;
 }
 
 template<size_t R, size_t N, typename Index>
-size_t Tuples<R,N,Index>::
-firstN( size_t R_, size_t N_, size_t j )
+bool Tuples<R,N,Index>::
+isPresentInMask( const Mask &mask, size_t k )
 {
-	assert(j <= (R_-N_) and "invalid number.");
-	size_t out=0;
-	for (size_t k=0; k<=j; k++)
+	// k>=R is not contained, this also keeps the shift below the width of the uint64_t
+	if (k >= R) {return false;}
+	if constexpr (R<=64) {return (mask >> k) & std::uint64_t(1);}
+	else {return mask.test(k);}
+}
+
+template<size_t R, size_t N, typename Index>
+std::vector<typename Tuples<R,N,Index>::Mask> Tuples<R,N,Index>::
+getMasks( const std::vector<size_t> &numbers )
+{
+	std::vector<Mask> out(numbers.size());
+	#ifdef _OPENMP
+	#pragma omp parallel for
+	#endif
+	for (long i=0; i<static_cast<long>(numbers.size()); i++)
 	{
-		out +=  binomial(R_-k-1,N_-1); //static_cast<size_t>(boost::math::binomial_coefficient<double>(R_-k-1, N_-1)); //
+		out[i] = getMask(numbers[i]);
 	}
 	return out;
 }
 
 template<size_t R, size_t N, typename Index>
-size_t Tuples<R,N,Index>::
-binomial (std::size_t n, std::size_t k)
+std::vector<size_t> Tuples<R,N,Index>::
+getNumbers( const std::vector<Mask> &masks )
 {
-	return factorial(n)/(factorial(k)*factorial(n-k));
+	std::vector<size_t> out(masks.size());
+	#ifdef _OPENMP
+	#pragma omp parallel for
+	#endif
+	for (long i=0; i<static_cast<long>(masks.size()); i++)
+	{
+		out[i] = getNumberFromMask(masks[i]);
+	}
+	return out;
 }
 
 template<size_t R, size_t N, typename Index>
-size_t Tuples<R,N,Index>::
-factorial(size_t n)
+void Tuples<R,N,Index>::
+sort( std::array<Index,N> &tuple )
 {
-  return (n == 1 || n == 0) ? 1 : factorial(n - 1) * n;
+	std::sort(tuple.begin(),tuple.end());
 }
 
 #endif
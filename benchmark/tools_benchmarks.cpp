@@ -0,0 +1,280 @@
+// Benchmarks of the TOOLS kernels with machine-readable output, to catch performance regressions before an upgrade.
+//
+// compile (from this folder):
+// g++ -std=c++17 -O3 -march=native -fopenmp -DHDF5_WITH_TENSOR -I.. -I/usr/include/eigen3 -I/usr/include/hdf5/serial tools_benchmarks.cpp -o tools_benchmarks -lhdf5_cpp -lhdf5
+// (on Debian/Ubuntu: -lhdf5_serial_cpp -lhdf5_serial)
+//
+// run:
+// ./tools_benchmarks -out=bench_output.txt [-quick] [-filter=Geometry2D] [-tolerance=0.02] [-max_seconds=2]
+//
+// The results are written as JSON, one entry per benchmark with the statistics of the time per call in nanoseconds.
+// Compare two runs by the "name" and "median_ns" fields.
+
+#include <iostream>
+#include <sstream>
+#include <fstream>
+#include <string>
+#include <vector>
+#include <random>
+#include <numeric>
+#include <functional>
+#include <ctime>
+#ifdef _OPENMP
+#include <omp.h>
+#endif
+
+using namespace std;
+#include <Eigen/Dense>
+using namespace Eigen;
+
+#include "ArgParser.h"
+#include "StringStuff.h"
+#include "Stopwatch.h"
+#include "Logger.h"
+Logger lout;
+#include "EigenFiles.h"
+#include "ParamHandler.h"
+#include "Geometry2D.h" // before the Tensor module, which declares Eigen::array
+#include "Permutations.h"
+#include "Tuples.h"
+#include "HDF5Interface.h"
+
+/**Discards everything written to it.*/
+struct NullBuffer : public streambuf
+{
+	int overflow (int c) {return c;}
+};
+
+struct BenchmarkEntry
+{
+	string name;
+	BenchmarkResult res;
+};
+
+string json (const vector<BenchmarkEntry> &entries, const ArgParser &args)
+{
+	time_t now = time(NULL);
+	char date[64];
+	strftime(date, sizeof(date), "%Y-%m-%dT%H:%M:%S", localtime(&now));
+	
+	int threads = 1;
+	#ifdef _OPENMP
+	threads = omp_get_max_threads();
+	#endif
+	
+	stringstream ss;
+	ss << setprecision(6);
+	ss << "{\n";
+	ss << "\"context\": {\"date\": \"" << date << "\", \"compiler\": \"" << json_escape(__VERSION__) << "\", \"threads\": " << threads
+	   << ", \"arguments\": \"" << json_escape(args.info()) << "\"},\n";
+	ss << "\"benchmarks\": [";
+	for (size_t i=0; i<entries.size(); ++i)
+	{
+		const BenchmarkResult &r = entries[i].res;
+		ss << ((i==0)? "\n" : ",\n");
+		ss << "{\"name\": \"" << json_escape(entries[i].name) << "\""
+		   << ", \"median_ns\": " << 1e9*r.median
+		   << ", \"mad_ns\": " << 1e9*r.mad
+		   << ", \"mean_ns\": " << 1e9*r.mean
+		   << ", \"min_ns\": " << 1e9*r.min
+		   << ", \"max_ns\": " << 1e9*r.max
+		   << ", \"p05_ns\": " << 1e9*r.p05
+		   << ", \"p25_ns\": " << 1e9*r.p25
+		   << ", \"p75_ns\": " << 1e9*r.p75
+		   << ", \"p95_ns\": " << 1e9*r.p95
+		   << ", \"repetitions\": " << r.repetitions
+		   << ", \"calls_per_sample\": " << r.calls_per_sample
+		   << ", \"stable\": " << ((r.STABLE)? "true" : "false") << "}";
+	}
+	ss << "\n]\n}\n";
+	return ss.str();
+}
+
+int main (int argc, char* argv[])
+{
+	ArgParser args(argc,argv);
+	bool QUICK = args.get<bool>("quick",false);
+	string outfile = args.get<string>("out","bench_output.txt");
+	string filter = args.get<string>("filter","");
+	string tmpdir = args.get<string>("tmp","./");
+	correct_foldername(tmpdir);
+	
+	BenchmarkOptions opt;
+	opt.tolerance = args.get<double>("tolerance",0.02);
+	opt.max_seconds = args.get<double>("max_seconds",(QUICK)? 0.5:2.);
+	if (QUICK) {opt.max_repetitions = 50;}
+	
+	Stopwatch<> Watch;
+	vector<BenchmarkEntry> entries;
+	auto selected = [&] (const string &name) {return filter.size() == 0 or name.find(filter) != string::npos;};
+	auto run = [&] (string name, auto&& f)
+	{
+		if (!selected(name)) {return;}
+		entries.push_back({name, Watch.benchmark(name, opt, f)});
+	};
+	
+	mt19937 gen(42);
+	uniform_real_distribution<double> dist(-1.,1.);
+	auto random_matrix = [&] (int rows, int cols)
+	{
+		MatrixXd M(rows,cols);
+		for (int i=0; i<M.size(); ++i) {M.data()[i] = dist(gen);}
+		return M;
+	};
+	
+	//---------------HDF5Interface---------------
+	for (int L : (QUICK)? vector<int>{10,100} : vector<int>{10,100,1000})
+	{
+		MatrixXd M = random_matrix(L,L);
+		string h5file = make_string(tmpdir,"bench_matrix_",L,".h5");
+		run(make_string("HDF5Interface/save_matrix/L=",L), [&] ()
+		{
+			HDF5Interface target(h5file, WRITE);
+			target.save_matrix(M, "M");
+			target.close();
+		});
+		run(make_string("HDF5Interface/load_matrix/L=",L), [&] ()
+		{
+			HDF5Interface source(h5file, READ);
+			MatrixXd Mres;
+			source.load_matrix(Mres, "M");
+			source.close();
+			return Mres(0,0);
+		});
+		remove(h5file.c_str());
+	}
+	
+	#ifdef HDF5_WITH_TENSOR
+	for (int D : (QUICK)? vector<int>{10,30} : vector<int>{10,30,60})
+	{
+		Eigen::Tensor<double,3,Eigen::ColMajor,Eigen::Index> T(D,D,D);
+		T.setRandom();
+		string h5file = make_string(tmpdir,"bench_tensor_",D,".h5");
+		run(make_string("HDF5Interface/save_tensor/D=",D), [&] ()
+		{
+			HDF5Interface target(h5file, WRITE);
+			target.save_tensor<double,3>(T, "T");
+			target.close();
+		});
+		run(make_string("HDF5Interface/load_tensor/D=",D), [&] ()
+		{
+			HDF5Interface source(h5file, READ);
+			Eigen::Tensor<double,3,Eigen::ColMajor,Eigen::Index> Tres;
+			source.load_tensor<double,3>(Tres, "T");
+			source.close();
+			return Tres(0,0,0);
+		});
+		remove(h5file.c_str());
+	}
+	#endif
+	
+	//---------------EigenFiles---------------
+	// readMatrix is limited to MAXBUFSIZE elements
+	for (int L : (QUICK)? vector<int>{10,100} : vector<int>{10,100,300})
+	{
+		MatrixXd M = random_matrix(L,L);
+		string datfile = make_string(tmpdir,"bench_matrix_",L,".dat");
+		run(make_string("EigenFiles/saveMatrix/L=",L), [&] () {saveMatrix(M, datfile, false);});
+		run(make_string("EigenFiles/readMatrix/L=",L), [&] () {return readMatrix(datfile)(0,0);});
+		remove(datfile.c_str());
+	}
+	
+	//---------------Geometry2D---------------
+	for (size_t L : (QUICK)? vector<size_t>{4,8} : vector<size_t>{4,8,16,32})
+	for (auto type : {SQUARE,TRIANG})
+	{
+		string type_name = (type == SQUARE)? "SQUARE" : "TRIANG";
+		run(make_string("Geometry2D/construct/",type_name,"/L=",L,"/range=2"), [&] ()
+		{
+			Lattice2D lattice({L,L}, {true,true}, type, 2);
+			Geometry2D geo(lattice, SNAKE, {1.,0.5});
+			return geo.hoppingSparse(2).nonZeros();
+		});
+	}
+	
+	//---------------Permutation---------------
+	for (size_t N : (QUICK)? vector<size_t>{100,10000} : vector<size_t>{100,10000,1000000})
+	{
+		vector<size_t> pi(N);
+		iota(pi.begin(), pi.end(), 0);
+		shuffle(pi.begin(), pi.end(), gen);
+		Permutation p(pi);
+		vector<double> data(N);
+		for (auto &x : data) {x = dist(gen);}
+		vector<double> out(N);
+		
+		run(make_string("Permutation/initialize/N=",N), [&] () {p.initialize(); return p.cycles.size();});
+		// the adjacent swaps of a random permutation are O(N^2)
+		if (N <= 10000) {run(make_string("Permutation/decompose/N=",N), [&] () {return p.decompose().size();});}
+		run(make_string("Permutation/apply_inplace/N=",N), [&] () {p.apply(data);});
+		run(make_string("Permutation/apply_gather/N=",N), [&] () {p.apply(data.data(), out.data()); return out[0];});
+	}
+	
+	//---------------Tuples---------------
+	{
+		typedef Tuples<40,4> T;
+		vector<std::array<int,4> > tuples(1000);
+		vector<size_t> numbers(1000);
+		uniform_int_distribution<size_t> pick(0, T::size()-1);
+		for (size_t i=0; i<tuples.size(); ++i) {numbers[i] = pick(gen); tuples[i] = T::getTuple(numbers[i]);}
+		
+		// per call of the lambda, i.e. per 1000 tuples
+		run("Tuples/getNumber/R=40/N=4/x1000", [&] ()
+		{
+			size_t sum = 0;
+			for (const auto &t : tuples) {sum += T::getNumber(t);}
+			return sum;
+		});
+		run("Tuples/getTuple/R=40/N=4/x1000", [&] ()
+		{
+			int sum = 0;
+			for (size_t j : numbers) {sum += T::getTuple(j)[0];}
+			return sum;
+		});
+	}
+	
+	//---------------ParamHandler---------------
+	{
+		vector<Param> params = {{"t",1.},{"U",8.},{"J",0.5},{"Ly",4ul},{"V",0.1,1},{"mu",-0.2,1}};
+		map<string,any> defaults = {{"t",1.},{"U",0.},{"J",0.},{"V",0.},{"mu",0.},{"tPrime",0.},{"Ly",1ul}};
+		ParamHandler P(params,defaults);
+		run("ParamHandler/get/given", [&] () {return P.get<double>("U");});
+		run("ParamHandler/get/from_index0", [&] () {return P.get<double>("U",1);});
+		run("ParamHandler/get/default", [&] () {return P.get<double>("tPrime",1);});
+	}
+	
+	//---------------Logger---------------
+	if (selected("Logger/line") or selected("Logger/record"))
+	{
+		{
+			Logger L(string("bench_logger.log"), tmpdir);
+			int i = 0;
+			
+			if (selected("Logger/line"))
+			{
+				// the console output of the Logger is discarded during the measurement
+				NullBuffer null;
+				streambuf *console = cout.rdbuf(&null);
+				BenchmarkResult res_line = Watch.benchmark("Logger/line", opt, [&] ()
+				{
+					++i;
+					L << "sweep=" << i << ", E=" << -0.25*i << endl;
+				});
+				cout.rdbuf(console);
+				cout << res_line.info("Logger/line") << endl;
+				entries.push_back({"Logger/line", res_line});
+			}
+			
+			auto schema = L.define_record("sweep", {"i","E"});
+			run("Logger/record", [&] () {++i; L.record(schema, {double(i), -0.25*i});});
+			L.flush();
+		}
+		remove((tmpdir+"bench_logger.log").c_str());
+		remove((tmpdir+"bench_logger.rec").c_str());
+	}
+	
+	ofstream file(outfile);
+	file << json(entries, args);
+	file.close();
+	cout << "results saved to: " << outfile << endl;
+}